@@ -0,0 +1,296 @@
+#include <fstream>
+#include <sstream>
+#include <vector>
+#include <string>
+#include <chrono>
+#include <random>
+#include <iostream>
+#include <string.h>
+#include <sys/resource.h>
+
+#include "autopatterns.hpp"
+
+// Throughput benchmark of learn/match/descript/save/load operations.
+// Corpora are synthesized from template lines (given sample files) by randomizing
+// their numbers, plus generated syslog-like lines with wide variety of hostnames,
+// programs and messages. Prints one JSON object per measurement to stdout.
+
+typedef AutoPatterns<char> AutoPatternsC;
+
+static const char *s_months[] = {"Jan", "Feb", "Mar", "Apr", "May", "Jun", "Jul", "Aug", "Sep", "Oct", "Nov", "Dec"};
+static const char *s_programs[] = {"sshd", "cron", "kernel", "systemd", "dhclient", "NetworkManager", "sudo", "postfix/smtpd", "nginx", "dockerd"};
+static const char *s_words[] = {"session", "opened", "closed", "for", "user", "root", "accepted", "failed", "connection", "from",
+	"port", "timeout", "started", "stopped", "service", "request", "reply", "error", "warning", "info", "lease", "bound", "to"};
+
+class Generator
+{
+	std::mt19937 _rnd;
+	std::vector<std::string> _templates;
+
+	size_t Random(size_t n)
+	{
+		return std::uniform_int_distribution<size_t>(0, n - 1)(_rnd);
+	}
+
+	// replaces digits with random ones keeping overall look of template
+	std::string FromTemplate()
+	{
+		std::string out = _templates[Random(_templates.size())];
+		for (auto &c : out) {
+			if (c >= '0' && c <= '9') {
+				c = '0' + Random(10);
+			}
+		}
+		return out;
+	}
+
+	// message templates are fixed sequences of words and variable fields, like real programs have
+	enum Field {
+		F_IP = -1,
+		F_ID = -2,
+		F_NUMBER = -3
+	};
+
+	std::vector<std::vector<int> > _messages;
+
+	void GenerateMessages()
+	{
+		const int words_count = sizeof(s_words) / sizeof(s_words[0]);
+		for (size_t i = 0; i != 64; ++i) {
+			_messages.emplace_back();
+			for (size_t j = 0, n = 2 + Random(6); j != n; ++j) {
+				const size_t r = Random(8);
+				_messages.back().emplace_back((r < 3) ? -1 - (int)r : (int)Random(words_count));
+			}
+		}
+	}
+
+	std::string Syslog()
+	{
+		char buf[64];
+		std::string out = s_months[Random(12)];
+		snprintf(buf, sizeof(buf), " %2u %02u:%02u:%02u host%u ", (unsigned)Random(28) + 1,
+			(unsigned)Random(24), (unsigned)Random(60), (unsigned)Random(60), (unsigned)Random(64));
+		out+= buf;
+		const size_t message = Random(_messages.size());
+		out+= s_programs[message % (sizeof(s_programs) / sizeof(s_programs[0]))];
+		snprintf(buf, sizeof(buf), "[%u]:", (unsigned)Random(65536));
+		out+= buf;
+		for (const auto &field : _messages[message]) {
+			switch (field) {
+				case F_IP:
+					snprintf(buf, sizeof(buf), " %u.%u.%u.%u", (unsigned)Random(256),
+						(unsigned)Random(256), (unsigned)Random(256), (unsigned)Random(256));
+					break;
+				case F_ID:
+					snprintf(buf, sizeof(buf), " id=%08x%04x", (unsigned)_rnd(), (unsigned)Random(0x10000));
+					break;
+				case F_NUMBER:
+					snprintf(buf, sizeof(buf), " %u", (unsigned)Random(100000));
+					break;
+				default:
+					snprintf(buf, sizeof(buf), " %s", s_words[field]);
+			}
+			out+= buf;
+		}
+		return out;
+	}
+
+	// anomaly is a usual line with unseen word inserted into it
+	std::string Anomaly()
+	{
+		std::string out = (_templates.empty() || Random(2)) ? Syslog() : FromTemplate();
+		size_t pos = out.rfind(' ', Random(out.size()));
+		if (pos == std::string::npos) {
+			pos = 0;
+		}
+		out.insert(pos, " unexpected");
+		return out;
+	}
+
+public:
+	Generator(unsigned seed) : _rnd(seed)
+	{
+		GenerateMessages();
+	}
+
+	void AddTemplates(const char *path)
+	{
+		std::ifstream is(path);
+		std::string line;
+		while (std::getline(is, line)) if (!line.empty()) {
+			_templates.emplace_back(line);
+		}
+	}
+
+	// generates given amount of lines, 1 of each anomaly_ratio lines is anomaly if its nonzero
+	std::vector<std::string> Generate(size_t count, size_t anomaly_ratio = 0)
+	{
+		std::vector<std::string> out;
+		out.reserve(count);
+		while (out.size() < count) {
+			if (anomaly_ratio && Random(anomaly_ratio) == 0) {
+				out.emplace_back(Anomaly());
+			} else {
+				out.emplace_back((_templates.empty() || Random(2)) ? Syslog() : FromTemplate());
+			}
+		}
+		return out;
+	}
+};
+
+// Peak RSS is tracked by kernel for whole process lifetime, so on Linux its
+// reset before each measurement to report peak of that operation only.
+// Elsewhere (or if reset not permitted) whole process peak is reported.
+static bool ResetPeakRSS()
+{
+	std::ofstream os("/proc/self/clear_refs");
+	os << "5";
+	os.close();
+	return !!os;
+}
+
+static size_t PeakRSS()
+{
+	std::ifstream is("/proc/self/status");
+	for (std::string line; std::getline(is, line); ) {
+		if (line.compare(0, 6, "VmHWM:") == 0) {
+			return strtoul(line.c_str() + 6, nullptr, 10);
+		}
+	}
+	struct rusage ru{};
+	getrusage(RUSAGE_SELF, &ru);
+	return ru.ru_maxrss;
+}
+
+static size_t TotalSize(const std::vector<std::string> &lines)
+{
+	size_t out = 0;
+	for (const auto &line : lines) {
+		out+= line.size() + 1;
+	}
+	return out;
+}
+
+class Bench
+{
+	std::chrono::steady_clock::time_point _start;
+	bool _peak_reset = false;
+
+public:
+	void Start()
+	{
+		_peak_reset = ResetPeakRSS();
+		_start = std::chrono::steady_clock::now();
+	}
+
+	void Report(const char *op, size_t corpus, size_t lines, size_t bytes, size_t nodes)
+	{
+		const double seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - _start).count();
+		const double safe_seconds = std::max(seconds, 1e-9);
+		printf("{\"op\":\"%s\",\"corpus\":%lu,\"lines\":%lu,\"bytes\":%lu,\"seconds\":%.6f,"
+			"\"lines_per_s\":%.0f,\"mb_per_s\":%.3f,\"%s\":%lu,\"nodes\":%lu}\n",
+			op, (unsigned long)corpus, (unsigned long)lines, (unsigned long)bytes, seconds,
+			lines / safe_seconds, bytes / safe_seconds / 1048576,
+			_peak_reset ? "peak_rss_kb" : "process_peak_rss_kb", (unsigned long)PeakRSS(), (unsigned long)nodes);
+		fflush(stdout);
+	}
+};
+
+static void BenchCorpus(Generator &gen, size_t corpus, size_t descript_limit)
+{
+	const auto learn_lines = gen.Generate(corpus);
+	const auto eval_lines = gen.Generate(corpus, 100);
+	Bench b;
+
+	AutoPatternsC::Trie trie;
+	b.Start();
+	trie.Learn(learn_lines);
+	const size_t nodes = trie.NodesCount();
+	b.Report("learn", corpus, learn_lines.size(), TotalSize(learn_lines), nodes);
+
+	std::vector<std::string> mismatched;
+	b.Start();
+	for (const auto &line : eval_lines) {
+		if (!trie.Match(line)) {
+			mismatched.emplace_back(line);
+		}
+	}
+	b.Report("match", corpus, eval_lines.size(), TotalSize(eval_lines), nodes);
+
+	AutoPatternsC::MatchCache cache(0x10000);
+	b.Start();
+	for (const auto &line : eval_lines) {
+		trie.Match(line, cache);
+	}
+	b.Report("match_cached", corpus, eval_lines.size(), TotalSize(eval_lines), nodes);
+
+	if (mismatched.size() > descript_limit) {
+		mismatched.resize(descript_limit);
+	}
+	b.Start();
+	for (const auto &line : mismatched) {
+		trie.Descript(line);
+	}
+	b.Report("descript", corpus, mismatched.size(), TotalSize(mismatched), nodes);
+
+	std::ostringstream text_os, binary_os;
+	b.Start();
+	trie.Save(text_os, false);
+	const std::string text = text_os.str();
+	b.Report("save", corpus, 1, text.size(), nodes);
+
+	b.Start();
+	trie.SaveBinary(binary_os);
+	const std::string binary = binary_os.str();
+	b.Report("save_binary", corpus, 1, binary.size(), nodes);
+
+	b.Start();
+	{
+		std::istringstream is(text);
+		AutoPatternsC::Trie loaded(is);
+		b.Report("load", corpus, 1, text.size(), loaded.NodesCount());
+	}
+
+	b.Start();
+	{
+		AutoPatternsC::Trie loaded(binary.data(), binary.size());
+		b.Report("load_binary", corpus, 1, binary.size(), loaded.NodesCount());
+	}
+}
+
+int main(int argc, char **argv)
+{
+	std::vector<size_t> corpora{10000, 50000, 200000};
+	size_t descript_limit = 100;
+	Generator gen(1);
+
+	for (int i = 1; i < argc; ++i) {
+		if (strcmp(argv[i], "-corpora") == 0 && i + 1 < argc) {
+			corpora.clear();
+			for (std::istringstream is(argv[++i]); ;) {
+				size_t corpus;
+				if (!(is >> corpus)) {
+					break;
+				}
+				corpora.emplace_back(corpus);
+				is.ignore(1, ',');
+			}
+
+		} else if (strcmp(argv[i], "-descript-limit") == 0 && i + 1 < argc) {
+			descript_limit = atoi(argv[++i]);
+
+		} else if (argv[i][0] == '-') {
+			std::cerr << "Usage: bench [-corpora N1,N2..] [-descript-limit N] [TEMPLATE_FILE1 [TEMPLATE_FILE2..]]" << std::endl;
+			return 1;
+
+		} else {
+			gen.AddTemplates(argv[i]);
+		}
+	}
+
+	for (const auto corpus : corpora) {
+		BenchCorpus(gen, corpus, descript_limit);
+	}
+	return 0;
+}
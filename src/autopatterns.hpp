@@ -9,14 +9,15 @@
 #include <memory>
 #include <algorithm>
 #include <vector>
-#include <list>
 #include <string>
 #include <ostream>
 #include <istream>
 #include <sstream>
-#include <chrono>
 #include <limits>
+#include <iterator>
+#include <unordered_map>
 #include <assert.h>
+#include <string.h>
 
 #ifdef HAVE_STRING_VIEW
 # include <string_view>
@@ -25,19 +26,14 @@
 #endif
 
 #include "tokens.hpp"
+#include "frozen.hpp"
+#include "tokenizer.hpp"
 #include "utils.hpp"
+#include "lru.hpp"
 
 template <class CharT, size_t ConvergeThreshold = 2>
-	class AutoPatterns : protected AutoPatternsUtils
+	class AutoPatterns : protected AutoPatternsTokenizer
 {
-enum {
-	DESCRIPT_NESTING_MATCHES_TRH = 2,
-	DESCRIPT_LIMIT_REDUNDANTS = 8,
-	DESCRIPT_LIMIT_MISSES = 8,
-	DESCRIPT_LIMIT_TIME = 5,
-	BINSEARCH_THRESHOLD = 10
-};
-
 typedef std::basic_string<CharT> String;
 #ifdef HAVE_STRING_VIEW
 typedef std::basic_string_view<CharT> StringView;
@@ -54,21 +50,23 @@ typedef AutoPatternsTokens<String, StringView, IStream, OStream> Tokens;
 typedef typename Tokens::NodePtr TokenNodePtr;
 typedef typename Tokens::Node TokenNode;
 typedef typename Tokens::Nodes TokenNodes;
+typedef typename Tokens::Token Token;
 typedef typename Tokens::TokenString TokenString;
 typedef typename Tokens::TokenStringWithNumbers TokenStringWithNumbers;
 typedef typename Tokens::TokenStringClass TokenStringClass;
+typedef typename Tokens::TokenValue TokenValue;
+typedef AutoPatternsFrozen<String, StringView, Tokens> Frozen;
+typedef Tokenized<StringView> TokenizedSample;
 
 public:
 
 /******************************* PUBLIC INTERFACE **************************************/
 
-enum TokenStatus : unsigned char
-{
-	TS_MATCH = 0,
-	TS_MISMATCH,
-	TS_REDUNDANT,
-	TS_MISSING
-};
+typedef AutoPatternsUtils::TokenStatus TokenStatus;
+using AutoPatternsUtils::TS_MATCH;
+using AutoPatternsUtils::TS_MISMATCH;
+using AutoPatternsUtils::TS_REDUNDANT;
+using AutoPatternsUtils::TS_MISSING;
 
 struct TokenDescription
 {
@@ -79,6 +77,92 @@ struct TokenDescription
 /// Returned by Trie::Descript - see its comment for details
 typedef std::vector<TokenDescription> SampleDescription;
 
+enum {
+	DESCRIPT_BUDGET_DEFAULT = 1000000,
+	SAVE_CHUNK = 0x100000 // saved text is written to stream by chunks of such size
+};
+
+struct Trie;
+
+/// Bounded cache of recent results of Trie::Match(sample, cache), makes repeating
+/// lines to avoid tokenizing and walking trie. Cached lines are indexed by their
+/// shape - with all decimal digits replaced by zeroes - and each keeps positions
+/// of digits that were matched by string-class matchers, so any other digits there
+/// give same result. Thus lines differing only by numbers hit same cache entry
+/// while results stay same as of uncached Match().
+/// Not thread-safe, so use own instance for each thread.
+class MatchCache
+{
+	friend struct Trie;
+
+	struct Line
+	{
+		String line;
+		std::vector<char> any_digits; // nonzero at positions where any digit matches
+		std::vector<std::pair<uint32_t, uint32_t> > classed; // offsets and lengths of tokens containing them
+		bool matched;
+	};
+
+	AutoPatternsLRU<Line> _lines;
+	std::vector<uint32_t> _path;
+	TokenizedSample _ts;
+	std::shared_ptr<const Frozen> _snapshot; // of trie that cached results belong to
+
+	static inline bool IsDigit(CharT c)
+	{
+		return c >= '0' && c <= '9';
+	}
+
+	// FNV-1a hash of line's shape
+	static uint64_t ShapeKey(const StringView &line)
+	{
+		uint64_t out = 14695981039346656037ull;
+		for (const auto &c : line) {
+			out = (out ^ (uint64_t)(IsDigit(c) ? '0' : c)) * 1099511628211ull;
+		}
+		return out;
+	}
+
+	static bool SameResult(const Line &cached, const StringView &line)
+	{
+		if (cached.line.size() != line.size()) {
+			return false;
+		}
+		bool differs = false;
+		for (size_t i = 0; i != line.size(); ++i) {
+			if (cached.line[i] != line[i]) {
+				if (!cached.any_digits[i] || !IsDigit(line[i])) {
+					return false;
+				}
+				differs = true;
+			}
+		}
+		// changed digits may still change class of token (like '0x' prefix makes it hex),
+		// class node matches token of same length only if its class stays same
+		if (differs) {
+			const StringView cached_line(cached.line.data(), cached.line.size());
+			for (const auto &span : cached.classed) {
+				const StringView token = line.substr(span.first, span.second);
+				const StringView cached_token = cached_line.substr(span.first, span.second);
+				if (token != cached_token && ClassifyString(token) != ClassifyString(cached_token)) {
+					return false;
+				}
+			}
+		}
+		return true;
+	}
+
+public:
+	/// Creates cache of up to capacity lines, capacity must be nonzero
+	MatchCache(size_t capacity)
+		: _lines(capacity)
+	{
+	}
+
+	size_t lookups = 0;
+	size_t hits = 0;
+};
+
 /// Main class to be instantiated and manipulated by user
 struct Trie
 {
@@ -87,56 +171,247 @@ struct Trie
 	{
 	}
 
-	/// Creates trie and loads from stream previously Save()'ed learned patterns into it
+	~Trie()
+	{
+		if (!_heap_nodes) { // all nodes are in arena, so destroying it frees them at once
+			Abandon(_root.kidz);
+		}
+	}
+
+	/// Creates trie and loads from stream previously Save()'ed learned patterns into it.
+	/// Stream is read in bulk and parsed from memory, malformed text trie reported by
+	/// exception telling number of bad line.
 	Trie(IStream &is)
 	{
-		String identity;
-		if (!std::getline(is, identity)) {
-			throw std::runtime_error("empty trie");
+		String content;
+		ReadAll(is, content);
+		const char *binary_identity = Frozen::BinaryIdentity();
+		const size_t binary_identity_len = strlen(binary_identity);
+		if (content.size() >= binary_identity_len
+		  && std::equal(binary_identity, binary_identity + binary_identity_len, content.begin())) {
+			_binary = std::move(content);
+			Attach(_binary.data(), _binary.size() * sizeof(CharT));
+			return;
 		}
-		if (identity != "AutoPatternsTrie:1") {
-			throw std::runtime_error("bad trie format");
+		Parse(content.data(), content.data() + content.size());
+	}
+
+	/// Creates trie from previously Save()'ed learned patterns kept in memory (like mapped file),
+	/// memory isn't used after construction
+	explicit Trie(const StringView &text)
+	{
+		Parse(text.data(), text.data() + text.size());
+	}
+
+	/// Creates trie that uses previously SaveBinary()'ed patterns directly from given memory
+	/// (like mapped file) without copying them, so that memory must stay valid and unchanged
+	/// during whole lifetime of this trie
+	Trie(const void *data, size_t size)
+	{
+		Attach(data, size);
+	}
+
+	/// Returns true if given memory looks like SaveBinary()'ed patterns
+	static bool IsBinary(const void *data, size_t size)
+	{
+		return Frozen::IsBinary(data, size);
+	}
+
+	/// Builds compact read-only representation of trie used by Match() and Descript().
+	/// Its done automatically by first Match() or Descript() after load, but must be
+	/// called explicitly before calling them concurrently. Once its done, Match() and
+	/// Descript() use immutable snapshot of that representation, and following Learn()
+	/// builds its next version replacing snapshot atomically only when its complete.
+	/// So they may be called concurrently with Learn(), Save() and other modifying
+	/// methods without any locking, using trie as it was before them.
+	void Freeze()
+	{
+		if (!std::atomic_load(&_snapshot)) {
+			Publish();
+		}
+	}
+
+	/// Recreates full trie from compact read-only representation if it was loaded from binary.
+	/// Its done automatically by Learn().
+	void Thaw()
+	{
+		if (!_tree_valid) {
+			AutoPatternsArena::Scope scope(_arena.get());
+			std::atomic_load(&_snapshot)->Thaw(_root);
+			_tree_valid = true;
 		}
-		_root.Deserialize(is);
-		TransformToMemoryRepresentation(_root.kidz);
 	}
 
-	/// Saves current trie into file, that can be loaded in future to avoid full dataset re-learnings
-	void Save(OStream &os, bool compact)
+	/// Makes trie not to refer memory given to Trie(const void *, size_t) anymore,
+	/// so that memory may be released or overwritten (like when saving into its file)
+	void Detach()
 	{
-		os << "AutoPatternsTrie:1" << std::endl;
-		TransformToStorageRepresentation(_root.kidz);
-		_root.Serialize(os, compact);
-		TransformToMemoryRepresentation(_root.kidz);
+		Thaw();
+		if (std::atomic_load(&_snapshot)) {
+			Publish();
+		}
+	}
+
+	/// Saves current trie into file, that can be loaded in future to avoid full dataset re-learnings.
+	/// Trie stays unmodified, so it may be saved concurrently with Match() and other Save() calls.
+	void Save(OStream &os, bool compact) const
+	{
+		if (_tree_valid) {
+			SaveTree(os, compact, _root);
+			return;
+		}
+		// thawed temporarily into own arena, as trie's one may be used concurrently
+		AutoPatternsArena arena;
+		TokenNode thawed;
+		{
+			AutoPatternsArena::Scope scope(&arena);
+			std::atomic_load(&_snapshot)->Thaw(thawed);
+		}
+		SaveTree(os, compact, thawed);
+		Abandon(thawed.kidz);
+	}
+
+	/// Makes trie to keep structurally identical subtrees only once: compact read-only
+	/// representation used for matching and by SaveBinary() becomes DAG, and Save()
+	/// writes references to already written subtrees instead of their copies.
+	/// Text saved that way has newer version, its loading enables sharing automatically.
+	void ShareSubtrees(bool share = true)
+	{
+		if (_share_subtrees != share) {
+			_share_subtrees = share;
+			if (std::atomic_load(&_snapshot)) {
+				Thaw(); // binary one could be made with different sharing
+				Publish();
+			}
+		}
+	}
+
+	/// Saves current trie in binary form that is platform-dependent but can be loaded
+	/// and used by Match() without any parsing or copying, see Trie(const void *, size_t)
+	void SaveBinary(OStream &os)
+	{
+		Freeze();
+		std::atomic_load(&_snapshot)->SaveBinary(os);
 	}
 
 	/// Learns given set of samples, making them (and similar) samples recognized in future by Match()
+	/// If threads > 1 then learning uses that much threads producing exactly same trie.
 	template <class SamplesT>
-		void Learn(const SamplesT &samples)
+		void Learn(const SamplesT &samples, size_t threads = 1)
 	{
+		Thaw();
 		StringViewVec refined_samples(samples.size());
 		std::copy(samples.begin(), samples.end(), refined_samples.begin());
 		SortAndUniq(refined_samples);
-		BuildPatternTreeRecurse(_root.kidz, refined_samples);
-		ConvergeSimilarNodes(_root.kidz);
+		{
+			AutoPatternsArena::Scope scope(_arena.get());
+			if (threads > 1) {
+				_heap_nodes = true; // other threads have no arena
+				BuildPatternTreeParallel(_root.kidz, refined_samples, threads);
+			} else {
+				BuildPatternTreeRecurse(_root.kidz, refined_samples);
+			}
+			ConvergeSimilarNodes(_root.kidz, threads);
+		}
+		Compact();
+		if (std::atomic_load(&_snapshot)) { // frozen one is in use, so replace it
+			Publish();
+		}
+	}
+
+	/// Returns amount of learned trie nodes
+	size_t NodesCount() const
+	{
+		return _tree_valid ? CountNodes(_root.kidz) : std::atomic_load(&_snapshot)->NodesCount() - 1;
 	}
 
 	/// Simple and fast matcher - returns true if given sample matches to learned trie
 	template <class SampleT>
 		bool Match(const SampleT &sample)
 	{
-		return MatchByNodes(sample, _root.kidz);
+		static thread_local TokenizedSample ts;
+		ts.Assign(sample);
+		return Snapshot()->Match(ts);
+	}
+
+	/// Same as simple matcher but uses given cache to avoid walking trie for repeating lines
+	template <class SampleT>
+		bool Match(const SampleT &sample, MatchCache &cache)
+	{
+		auto snapshot = Snapshot();
+		if (cache._snapshot != snapshot) {
+			cache._lines.Clear();
+			cache._snapshot = snapshot;
+		}
+		++cache.lookups;
+		const StringView &line = sample;
+		const uint64_t key = MatchCache::ShapeKey(line);
+		const auto *cached = cache._lines.Lookup(key);
+		if (cached && MatchCache::SameResult(*cached, line)) {
+			++cache.hits;
+			return cached->matched;
+		}
+
+		cache._ts.Assign(line);
+		auto &inserted = cache._lines.Insert(key);
+		inserted.matched = snapshot->Match(cache._ts, cache._path);
+		inserted.line.assign(line.begin(), line.end());
+		inserted.any_digits.assign(line.size(), 0);
+		inserted.classed.clear();
+		if (inserted.matched) {
+			for (size_t index = 0; index != cache._path.size(); ++index) {
+				if (snapshot->MatchesAnyDigits(cache._path[index])) {
+					const auto &span = cache._ts.spans[index];
+					std::fill_n(inserted.any_digits.begin() + span.offset, span.length, 1);
+					inserted.classed.emplace_back(span.offset, span.length);
+				}
+			}
+		}
+		return inserted.matched;
+	}
+
+	/// Batched matcher - sets each of results to nonzero if corresponding sample matches
+	/// to learned trie. Samples having common heading tokens walk trie together, so its
+	/// faster than matching them one by one.
+	template <class SamplesT>
+		void Match(const SamplesT &samples, std::vector<char> &results)
+	{
+		// samples processed by chunks that fit into cache well
+		enum { CHUNK = 256 };
+		static thread_local std::vector<TokenizedSample> tss(CHUNK);
+		results.resize(samples.size());
+		const auto snapshot = Snapshot();
+		size_t offset = 0, count = 0;
+		for (const auto &sample : samples) {
+			tss[count++].Assign(sample);
+			if (count == CHUNK) {
+				snapshot->Match(tss.data(), count, results.data() + offset);
+				offset+= count;
+				count = 0;
+			}
+		}
+		if (count) {
+			snapshot->Match(tss.data(), count, results.data() + offset);
+		}
 	}
 
 	/// Verbose matcher - returns per-token sequence of description that indicates
 	/// best match path in trie, and each desciption shows token value and its
-	/// status - either token mismatched, or redundant, or something missing
+	/// status - either token mismatched, or redundant, or something missing.
+	/// Search of best path explores at most budget states, if its not enough then
+	/// close but maybe not best path described and exhausted set (if not null).
 	template <class SampleT>
-		SampleDescription Descript(const SampleT &sample)
+		SampleDescription Descript(const SampleT &sample,
+			size_t budget = DESCRIPT_BUDGET_DEFAULT, bool *exhausted = nullptr)
 	{
+		TokenizedSample ts;
+		ts.Assign(sample);
 		SampleStatus sample_status;
-		StatusByNodesContext ctx;
-		StatusByNodes(sample_status, sample, _root.kidz, ctx);
+		bool budget_exhausted;
+		Snapshot()->Descript(sample_status, ts, budget, budget_exhausted);
+		if (exhausted) {
+			*exhausted = budget_exhausted;
+		}
 		// Sample_status now represents status of each token
 		// (present or missing) of specified sample that describes
 		// found closest match.
@@ -144,25 +419,145 @@ struct Trie
 		// by tokens and compose resulting vector of elements each
 		// representing token status and (if not missing) value.
 		SampleDescription out;
-		StringView tail = sample;
+		size_t index = 0;
 		for (const auto &token_status : sample_status) {
 			out.emplace_back();
 			out.back().status = token_status;
 			if (token_status != TS_MISSING) {
-				out.back().token = HeadingToken(tail);
-				tail = tail.substr(out.back().token.size());
+				out.back().token = ts.Token(index);
+				if (index < ts.size()) {
+					++index;
+				}
 			}
 		}
-		if (!tail.empty()) {
-			// StatusByNodes returned inconsistent amount of statuses
-			std::cerr << std::endl << "UNDESCRIPTED_TAIL:" << tail << std::endl;
+		if (index != ts.size()) {
+			// Descript returned inconsistent amount of statuses
+			std::cerr << std::endl << "UNDESCRIPTED_TAIL:"
+				<< ts.line.substr(ts.spans[index].offset) << std::endl;
 			abort();
 		}
 		return out;
 	}
 
 private:
+	std::unique_ptr<AutoPatternsArena> _arena{new AutoPatternsArena}; // of _root's nodes, so declared before it
 	TokenNode _root;
+	std::shared_ptr<const Frozen> _snapshot; // accessed only atomically, see Freeze()
+	String _binary; // content of binary trie loaded from stream, _snapshot may refer to it
+	bool _tree_valid = true; // false if trie loaded from binary and _root not yet thawed from _snapshot
+	bool _share_subtrees = false;
+	bool _heap_nodes = false; // if parallel learning made some of _root's nodes out of _arena
+
+	static void ReadAll(IStream &is, String &out)
+	{
+		enum { CHUNK = 0x100000 };
+		for (;;) {
+			const size_t size = out.size();
+			out.resize(size + CHUNK);
+			is.read(&out[size], CHUNK);
+			out.resize(size + is.gcount());
+			if (!is) {
+				break;
+			}
+		}
+	}
+
+	// parses Save()'ed text, throws on malformed one
+	void Parse(const CharT *begin, const CharT *end)
+	{
+		AutoPatternsArena::Scope scope(_arena.get());
+		if (begin == end) {
+			throw std::runtime_error("empty trie");
+		}
+		// version 2 differs only by references to shared subtrees
+		static const char identity[] = "AutoPatternsTrie:?";
+		const size_t identity_len = sizeof(identity) - 1;
+		const CharT *eol = std::find(begin, end, '\n');
+		const CharT *identity_end = eol;
+		while (identity_end != begin && IsEOL(identity_end[-1])) {
+			--identity_end;
+		}
+		if (size_t(identity_end - begin) != identity_len
+		  || !std::equal(identity, identity + identity_len - 1, begin)
+		  || (begin[identity_len - 1] != '1' && begin[identity_len - 1] != '2')) {
+			throw std::runtime_error("bad trie format");
+		}
+		_share_subtrees = (begin[identity_len - 1] == '2');
+		_root.Deserialize((eol != end) ? eol + 1 : end, end, 2, _share_subtrees);
+		SortLoadedNodes(_root.kidz);
+	}
+
+	void SaveTree(OStream &os, bool compact, const TokenNode &root) const
+	{
+		if (!_share_subtrees) {
+			os << "AutoPatternsTrie:1" << std::endl;
+			Saver(os, compact).Kidz(root.kidz, 0);
+			return;
+		}
+		// shared subtrees are found by building DAG of trie being saved
+		Frozen dag;
+		dag.Build(root, true);
+		os << "AutoPatternsTrie:2" << std::endl;
+		Saver(os, compact, &dag).Kidz(root.kidz, 0);
+	}
+
+	// Forgets given nodes without destroying them one by one, their memory
+	// is freed by destruction of arena they were allocated from
+	static void Abandon(TokenNodes &kidz)
+	{
+		for (auto &kid : kidz) {
+			kid.release();
+		}
+		kidz.clear();
+	}
+
+	// Converging leaves arena full of freed objects, and parallel learning
+	// puts nodes to heap, so then trie is copied into new dense arena
+	void Compact()
+	{
+		if (!_heap_nodes && !_arena->Sparse()) {
+			return;
+		}
+		std::unique_ptr<AutoPatternsArena> arena(new AutoPatternsArena);
+		TokenNode old;
+		old.kidz.swap(_root.kidz);
+		{
+			AutoPatternsArena::Scope scope(arena.get());
+			_root.CopyKidz(old);
+		}
+		if (_heap_nodes) {
+			old.kidz.clear();
+			_heap_nodes = false;
+		} else {
+			Abandon(old.kidz);
+		}
+		_arena.swap(arena);
+	}
+
+	void Attach(const void *data, size_t size)
+	{
+		std::shared_ptr<Frozen> snapshot = std::make_shared<Frozen>();
+		snapshot->Attach(data, size);
+		std::atomic_store(&_snapshot, std::shared_ptr<const Frozen>(std::move(snapshot)));
+		_tree_valid = false;
+	}
+
+	void Publish()
+	{
+		std::shared_ptr<Frozen> snapshot = std::make_shared<Frozen>();
+		snapshot->Build(_root, _share_subtrees);
+		std::atomic_store(&_snapshot, std::shared_ptr<const Frozen>(std::move(snapshot)));
+	}
+
+	std::shared_ptr<const Frozen> Snapshot()
+	{
+		auto out = std::atomic_load(&_snapshot);
+		if (!out) {
+			Publish();
+			out = std::atomic_load(&_snapshot);
+		}
+		return out;
+	}
 
 	Trie(const Trie &) = delete;
 };
@@ -173,21 +568,132 @@ typedef std::unique_ptr<Trie> TriePtr;
 
 private:
 
-static TokenNode *ObtainSubnode(TokenNodes &kidz, const StringView &head, bool without_kidz)
+// tokens' strings are kept by arena, so their type differs from String
+static inline StringView View(const TokenValue &s)
 {
-	for (auto &kid : kidz) {
-		if (kid->kidz.empty() == without_kidz && kid->token->Match(head))  {
-			return kid.get();
+	return StringView(s.data(), s.size());
+}
+
+// Subtrees building postponed by BuildPatternTreeRecurse to be done later in parallel.
+// Each subnode gets list of subsamples sets to be learned into it in given order.
+struct DeferredSubtree
+{
+	TokenNode *subnode;
+	std::vector<StringViewVec> subsamples;
+};
+
+struct DeferredSubtrees : std::vector<DeferredSubtree>
+{
+	void Defer(TokenNode *subnode, StringViewVec &subsamples)
+	{
+		auto ir = _index.emplace(subnode, std::vector<DeferredSubtree>::size());
+		if (ir.second) {
+			std::vector<DeferredSubtree>::emplace_back();
+			std::vector<DeferredSubtree>::back().subnode = subnode;
 		}
+		(*this)[ir.first->second].subsamples.emplace_back();
+		(*this)[ir.first->second].subsamples.back().swap(subsamples);
 	}
 
-	kidz.emplace_back(new TokenNode);
-	kidz.back()->token.reset(new TokenString(head));
-	return kidz.back().get();
-}
+	bool Has(const TokenNode *subnode) const
+	{
+		return _index.find(subnode) != _index.end();
+	}
+
+private:
+	std::unordered_map<const TokenNode *, size_t> _index;
+};
 
-static void BuildPatternTreeRecurse(TokenNodes &kidz, const StringViewVec &samples)
+// Finds first kid that matches heading token and has kidz only if sample has tail,
+// creating new exact-string kid if there is no such kid. Wide nodes (like after
+// syslog headers) have thousands of exact-string kidz, so once kidz amount exceeds
+// threshold, these kidz are indexed by value while rest of kidz are still scanned.
+class SubnodeLookup
 {
+	enum {
+		INDEX_THRESHOLD = 16
+	};
+
+	typedef std::unordered_map<StringView, size_t, StringHasher<StringView> > KidzIndex;
+
+	TokenNodes &_kidz;
+	const DeferredSubtrees *_deferred;
+	std::vector<size_t> _class_kidz; // positions of not exact-string kidz
+	KidzIndex _string_kidz[2]; // first position of exact-string kid by value for kidz with and without own kidz
+	size_t _indexed = 0;
+
+	bool KidWithoutKidz(const TokenNode &kid) const
+	{
+		// deferred subnode will get its kidz later, so treat it like already having them
+		return kid.kidz.empty() && (!_deferred || !_deferred->Has(&kid));
+	}
+
+	// Kid's kidz presence doesn't change after it was indexed: existing kid obtained only
+	// with same presence and new kid gets its kidz right after creation (or deferred).
+	void UpdateIndex()
+	{
+		for (; _indexed < _kidz.size(); ++_indexed) {
+			const auto &kid = *_kidz[_indexed];
+			if (kid.token.Kind() == TK_STRING) {
+				_string_kidz[KidWithoutKidz(kid)].emplace(View(*kid.token.GetString()), _indexed);
+			} else {
+				_class_kidz.emplace_back(_indexed);
+			}
+		}
+	}
+
+	TokenNode *LookupIndexed(const StringView &head, bool without_kidz)
+	{
+		UpdateIndex();
+		size_t found = _kidz.size();
+		const auto &string_kidz = _string_kidz[without_kidz];
+		const auto it = string_kidz.find(head);
+		if (it != string_kidz.end()) {
+			found = it->second;
+		}
+		for (const auto pos : _class_kidz) {
+			if (pos >= found) {
+				break;
+			}
+			const auto &kid = *_kidz[pos];
+			if (KidWithoutKidz(kid) == without_kidz && kid.token.Match(head)) {
+				found = pos;
+				break;
+			}
+		}
+		return (found != _kidz.size()) ? _kidz[found].get() : nullptr;
+	}
+
+public:
+	SubnodeLookup(TokenNodes &kidz, const DeferredSubtrees *deferred)
+		: _kidz(kidz), _deferred(deferred)
+	{
+	}
+
+	TokenNode *Obtain(const StringView &head, bool without_kidz)
+	{
+		if (_kidz.size() > INDEX_THRESHOLD) {
+			TokenNode *kid = LookupIndexed(head, without_kidz);
+			if (kid) {
+				return kid;
+			}
+
+		} else for (auto &kid : _kidz) {
+			if (KidWithoutKidz(*kid) == without_kidz && kid->token.Match(head))  {
+				return kid.get();
+			}
+		}
+
+		_kidz.emplace_back(new TokenNode);
+		_kidz.back()->token = TokenString(head);
+		return _kidz.back().get();
+	}
+};
+
+static void BuildPatternTreeRecurse(TokenNodes &kidz, const StringViewVec &samples,
+	DeferredSubtrees *deferred = nullptr)
+{
+	SubnodeLookup lookup(kidz, deferred);
 	StringViewVec subsamples;
 	for (typename StringViewVec::const_iterator i = samples.begin(); i != samples.end();) {
 		if (i->empty()) {
@@ -195,49 +701,63 @@ static void BuildPatternTreeRecurse(TokenNodes &kidz, const StringViewVec &sampl
 			abort();
 		}
 
+		// Each sample's heading token scanned only once per nesting level,
+		// following samples of group just checked to have same heading token
 		StringView head = HeadingToken(*i);
 		if (head.size() < i->size()) {
 			do {
 				subsamples.emplace_back(i->substr(head.size()));
 				++i;
-			} while (i != samples.end() && i->size() > head.size() && HeadingToken(*i) == head);
+			} while (i != samples.end() && HasHeadingToken(*i, head));
 			SortAndUniq(subsamples);
 
 		} else {
 			++i;
 		}
 
-		TokenNode *subnode = ObtainSubnode(kidz, head, subsamples.empty());
+		TokenNode *subnode = lookup.Obtain(head, subsamples.empty());
+		if (!subsamples.empty()) {
+			subnode->MarkChanged();
+		}
 
 		if (!subsamples.empty()) {
-			BuildPatternTreeRecurse(subnode->kidz, subsamples);
+			if (deferred) {
+				deferred->Defer(subnode, subsamples);
+			} else {
+				BuildPatternTreeRecurse(subnode->kidz, subsamples);
+			}
 			subsamples.clear();
 		}
 	}
 }
 
-struct TokenNodeSearchCmp
+// Same as BuildPatternTreeRecurse but splits samples by heading token and
+// builds resulting subtrees in parallel, splitting further if not enough of them
+static void BuildPatternTreeParallel(TokenNodes &kidz, const StringViewVec &samples, size_t threads)
 {
-	bool operator() (const TokenNodePtr &l, const TokenNodePtr &r) const
-	{
-		const auto *lstr = l->token->GetString();
-		const auto *rstr = r->token->GetString();
-		assert(lstr && rstr);
-		return *lstr < *rstr;
-	}
-	bool operator() (const TokenNodePtr &l, const StringView &r) const
-	{
-		const auto *lstr = l->token->GetString();
-		assert(lstr);
-		return *lstr < r;
-	}
-	bool operator() (const StringView &l, const TokenNodePtr &r) const
-	{
-		const auto *rstr = r->token->GetString();
-		assert(rstr);
-		return l < *rstr;
+	DeferredSubtrees deferred;
+	BuildPatternTreeRecurse(kidz, samples, &deferred);
+
+	const size_t subtree_threads = std::max(threads / std::max(deferred.size(), (size_t)1), (size_t)1);
+	ParallelFor(deferred.size(), threads, [&](size_t i) {
+		for (const auto &subsamples : deferred[i].subsamples) {
+			if (subtree_threads > 1) {
+				BuildPatternTreeParallel(deferred[i].subnode->kidz, subsamples, subtree_threads);
+			} else {
+				BuildPatternTreeRecurse(deferred[i].subnode->kidz, subsamples);
+			}
+		}
+	});
+}
+
+static size_t CountNodes(const TokenNodes &kidz)
+{
+	size_t out = kidz.size();
+	for (const auto &kid : kidz) {
+		out+= CountNodes(kid->kidz);
 	}
-};
+	return out;
+}
 
 template <bool sort_for_converging>
 	static void SortNodes(TokenNodes &kidz)
@@ -245,11 +765,11 @@ template <bool sort_for_converging>
 	std::sort(kidz.begin(), kidz.end(),
 		[](const TokenNodePtr &a, const TokenNodePtr &b) -> bool
 	{ 
-		const auto *astr = a->token->GetString();
-		const auto *bstr = b->token->GetString();
+		const auto *astr = a->token.GetString();
+		const auto *bstr = b->token.GetString();
 
-		const auto acls = a->token->GetStringClass();
-		const auto bcls = a->token->GetStringClass();
+		const auto acls = a->token.GetStringClass();
+		const auto bcls = a->token.GetStringClass();
 
 		if (sort_for_converging) {
 			// those who have kidz and those who not - cannot be converged,
@@ -281,13 +801,13 @@ template <bool sort_for_converging>
 			}
 		}
 
-		const auto alenmin = a->token->GetLengthMin();
-		const auto blenmin = b->token->GetLengthMin();
+		const auto alenmin = a->token.GetLengthMin();
+		const auto blenmin = b->token.GetLengthMin();
 //		if (alenmin != blenmin) {
 			return (alenmin < blenmin);
 //		}
-//		const auto alenmax = a->token->GetLengthMax();
-//		const auto blenmax = b->token->GetLengthMax();
+//		const auto alenmax = a->token.GetLengthMax();
+//		const auto blenmax = b->token.GetLengthMax();
 //		return (alenmax < blenmax);
 	});
 }
@@ -302,12 +822,13 @@ static void EstimatedMinMaxLenExpand(size_t &min_len, size_t &max_len)
 	}
 }
 
-static void ConvergeNodesWithSimilarTokens(TokenNodes &kidz)
+static bool ConvergeNodesWithSimilarTokens(TokenNodes &kidz)
 {
 	TokenStringWithNumbers itswn;
+	bool out = false;
 
 	for (auto i = kidz.begin(); i != kidz.end(); ) {
-		auto sc = (*i)->token->GetStringClass();
+		auto sc = (*i)->token.GetStringClass();
 		if (sc == SCF_SPACES) {
 			// if token contains _only_ whitespaces then
 			// converge it with other _only_ whitespaces tokens
@@ -326,37 +847,37 @@ static void ConvergeNodesWithSimilarTokens(TokenNodes &kidz)
 			sc = SCF_INVALID;
 		}
 
-		size_t min_len = (*i)->token->GetLengthMin();
-		size_t max_len = (*i)->token->GetLengthMax();
+		size_t min_len = (*i)->token.GetLengthMin();
+		size_t max_len = (*i)->token.GetLengthMax();
 
 		bool all_same_strings = true;
 
-		const auto *istr = (*i)->token->GetString();
+		const auto *istr = (*i)->token.GetString();
 		if (istr) {
-			itswn.Reinit(*istr);
+			itswn.Reinit(View(*istr));
 		}
 
 		auto j = i;
 		for (++j; j != kidz.end() && (*i)->kidz.empty() == (*j)->kidz.empty(); ++j) {
-			const auto *jstr = (*j)->token->GetString();
+			const auto *jstr = (*j)->token.GetString();
 
 			if (sc != SCF_INVALID) {
-				if ((*j)->token->GetStringClass() != sc) {
+				if ((*j)->token.GetStringClass() != sc) {
 					break;
 				}
-				min_len = std::min(min_len, (*j)->token->GetLengthMin());
-				max_len = std::max(max_len, (*j)->token->GetLengthMax());
+				min_len = std::min(min_len, (*j)->token.GetLengthMin());
+				max_len = std::max(max_len, (*j)->token.GetLengthMax());
 
 				if (!istr || !jstr || *istr != *jstr) {
 					all_same_strings = false;
 				}
 
-			} else if (!istr || !jstr || !itswn.Match(*jstr)) {
+			} else if (!istr || !jstr || !itswn.Match(View(*jstr))) {
 				break;
 
 			} else {
-				min_len = std::min(min_len, (*j)->token->GetLengthMin());
-				max_len = std::max(max_len, (*j)->token->GetLengthMax());
+				min_len = std::min(min_len, (*j)->token.GetLengthMin());
+				max_len = std::max(max_len, (*j)->token.GetLengthMax());
 
 				if (*istr != *jstr) {
 					all_same_strings = false;
@@ -369,13 +890,13 @@ static void ConvergeNodesWithSimilarTokens(TokenNodes &kidz)
 		if (j - i > ConvergeThreshold || (j - i > 1 && (all_same_strings || sc == SCF_SPACES))) {
 			TokenNodePtr new_kid(new TokenNode);
 			if (all_same_strings) {
-				new_kid->token.reset(new TokenString(*(*i)->token->GetString()));
+				new_kid->token = TokenString(View(*(*i)->token.GetString()));
 
 			} else if (sc == SCF_INVALID) {
-				new_kid->token.reset(new TokenStringWithNumbers(*(*i)->token->GetString(), max_len));
+				new_kid->token = TokenStringWithNumbers(View(*(*i)->token.GetString()), max_len);
 
 			} else {
-				new_kid->token.reset(new TokenStringClass(sc, min_len, max_len));
+				new_kid->token = TokenStringClass(sc, min_len, max_len);
 			}
 			new_kid->kidz.reserve(new_kid->kidz.size() + (j - i));
 			for (auto k = i; k != j; ++k) {
@@ -386,104 +907,190 @@ static void ConvergeNodesWithSimilarTokens(TokenNodes &kidz)
 			*i = std::move(new_kid);
 			++i;
 			i = kidz.erase(i, j);
+			out = true;
 
 		} else {
 			i = j;
 		}
 	}
+	return out;
+}
+
+// Groups nodes which kidz subtrees are equal, keeping groups and nodes within them in original order
+static void GroupEqualKidz(std::vector<std::vector<size_t> > &groups, const TokenNodes &nodes,
+	const std::vector<size_t> &candidates)
+{
+	std::unordered_map<size_t, std::vector<size_t> > hash_groups; // subtree hash -> indices of groups
+	for (const auto &i : candidates) {
+		auto &same_hash_groups = hash_groups[nodes[i]->KidzHash()];
+		bool found = false;
+		for (const auto &g : same_hash_groups) {
+			if (nodes[groups[g].front()]->KidzEqual(*nodes[i])) {
+				groups[g].emplace_back(i);
+				found = true;
+				break;
+			}
+		}
+		if (!found) {
+			same_hash_groups.emplace_back(groups.size());
+			groups.emplace_back(1, i);
+		}
+	}
+}
+
+static void EraseMarkedNodes(TokenNodes &nodes, const std::vector<char> &erased)
+{
+	size_t j = 0;
+	for (size_t i = 0; i != nodes.size(); ++i) if (!erased[i]) {
+		if (i != j) {
+			nodes[j] = std::move(nodes[i]);
+		}
+		++j;
+	}
+	nodes.resize(j);
 }
 
-static void ConvergeNodesWithRandomTokensAndMatchingSubnodes(TokenNodes &nodes)
+static bool ConvergeNodesWithRandomTokensAndMatchingSubnodes(TokenNodes &nodes)
 {
-	std::vector<std::unique_ptr<std::basic_ostringstream<CharT>>> ss(nodes.size());
+	std::vector<size_t> candidates;
 	for (size_t i = 0; i < nodes.size(); ++i) {
-		const auto *si = nodes[i]->token->GetString();
+		const auto *si = nodes[i]->token.GetString();
 		if (si && (ClassifyString(*si) & SCF_MASK_ALNUM) != SCF_NO_ALNUM && IsRandomAlphaNums(*si)) {
-			ss[i].reset(new std::basic_ostringstream<CharT>);
-			nodes[i]->Serialize(*ss[i], true);
+			candidates.emplace_back(i);
 		}
 	}
+	if (candidates.size() <= ConvergeThreshold) {
+		return false;
+	}
+
+	std::vector<std::vector<size_t> > groups;
+	GroupEqualKidz(groups, nodes, candidates);
 
-	std::vector<size_t> group;
+	// Each node converges with all following nodes that have same subtree
+	// if there are enough of them and their merged tokens look random.
+	std::vector<char> erased;
 	String merged_tokens;
-	for (size_t i = 0; i + 1 < nodes.size(); ++i) if (ss[i]) {
-		group.clear();
-		const auto &si = ss[i]->str();
-		for (size_t j = i + 1; j < nodes.size(); ++j) if (ss[j]) {
-			if (si == ss[j]->str()) {
-				group.emplace_back(j);
+	for (const auto &group : groups) {
+		for (size_t first = 0; group.size() - first - 1 > ConvergeThreshold; ++first) {
+			merged_tokens.clear();
+			size_t min_len = std::numeric_limits<std::size_t>::max();
+			size_t max_len = 0;
+			for (size_t k = first + 1; k <= group.size(); ++k) {
+				const auto &token = nodes[group[(k < group.size()) ? k : first]]->token;
+				merged_tokens.append(token.GetString()->data(), token.GetString()->size());
+				min_len = std::min(min_len, token.GetLengthMin());
+				max_len = std::max(max_len, token.GetLengthMax());
 			}
+			if (!IsRandomAlphaNums(merged_tokens)) {
+				continue;
+			}
+			EstimatedMinMaxLenExpand(min_len, max_len);
+			StringClass sc = ClassifyString(merged_tokens) & SCF_MASK_ALNUM;
+			assert(sc != SCF_NO_ALNUM);
+			nodes[group[first]]->token = TokenStringClass(sc | SCF_RANDOM, min_len, max_len);
+			nodes[group[first]]->InvalidateHash();
+			erased.resize(nodes.size());
+			for (size_t k = first + 1; k < group.size(); ++k) {
+				erased[group[k]] = 1;
+			}
+			break;
 		}
-		if (group.size() <= ConvergeThreshold) {
-			continue;
-		}
-		group.emplace_back(i);
-		merged_tokens.clear();
+	}
 
-		size_t min_len = std::numeric_limits<std::size_t>::max();
-		size_t max_len = 0;
-		for (const auto &j : group) {
-			const auto &token = nodes[j]->token;
-			merged_tokens+= *token->GetString();
-			min_len = std::min(min_len, token->GetLengthMin());
-			max_len = std::max(max_len, token->GetLengthMax());
-		}
-		if (!IsRandomAlphaNums(merged_tokens)) {
-			continue;
-		}
-		EstimatedMinMaxLenExpand(min_len, max_len);
-		StringClass sc = ClassifyString(merged_tokens) & SCF_MASK_ALNUM;
-		assert(sc != SCF_NO_ALNUM);
-		nodes[i]->token.reset(new TokenStringClass(sc | SCF_RANDOM, min_len, max_len));
-		group.pop_back();
-		for (auto rit = group.rbegin(); rit != group.rend(); ++rit) {
-			nodes.erase(nodes.begin() + *rit);
-			ss.erase(ss.begin() + *rit);
-		}
+	if (erased.empty()) {
+		return false;
 	}
+	EraseMarkedNodes(nodes, erased);
+	return true;
 }
 
-static void ConvergeNodesWithMatchingTokens(TokenNodes &nodes)
+static bool ConvergeNodesWithMatchingTokens(TokenNodes &nodes)
 {
-	std::vector<std::unique_ptr<std::basic_ostringstream<CharT>>> ss(nodes.size());
+	// token hash -> indices of first nodes having different tokens with that hash
+	std::unordered_map<size_t, std::vector<size_t> > firsts;
+	std::vector<char> erased;
 	for (size_t i = 0; i < nodes.size(); ++i) {
-		ss[i].reset(new std::basic_ostringstream<CharT>);
-		nodes[i]->token->Serialize(*ss[i]);
-	}
-
-	for (size_t i = 0; i + 1 < nodes.size(); ++i) {
-		for (size_t j = i + 1; j < nodes.size(); ) {
-			if (ss[i]->str() == ss[j]->str() && nodes[i]->kidz.empty() == nodes[j]->kidz.empty()) {
-				for (auto &k : nodes[j]->kidz) {
-					nodes[i]->kidz.emplace_back(std::move(k));
+		auto &same_hash_firsts = firsts[nodes[i]->token.Hash()];
+		bool merged = false;
+		for (const auto &f : same_hash_firsts) {
+			if (nodes[f]->kidz.empty() == nodes[i]->kidz.empty() && nodes[f]->token.Equals(nodes[i]->token)) {
+				for (auto &k : nodes[i]->kidz) {
+					nodes[f]->kidz.emplace_back(std::move(k));
 				}
-				nodes.erase(nodes.begin() + j);
-				ss.erase(ss.begin() + j);
-			} else {
-				++j;
+				nodes[f]->MarkChanged();
+				erased.resize(nodes.size());
+				erased[i] = 1;
+				merged = true;
+				break;
 			}
 		}
+		if (!merged) {
+			same_hash_firsts.emplace_back(i);
+		}
 	}
+
+	if (erased.empty()) {
+		return false;
+	}
+	EraseMarkedNodes(nodes, erased);
+	return true;
 }
 
+// Returns true if kidz or their subtrees were changed.
+// Subtrees of kidz that are not dirty are already converged, so skipped.
+static bool ConvergeKidSubtree(TokenNode &kid, size_t threads)
+{
+	if (!kid.dirty) {
+		return false;
+	}
+	kid.dirty = false;
+	if (!ConvergeSimilarNodes(kid.kidz, threads)) {
+		return false;
+	}
+	kid.InvalidateHash();
+	return true;
+}
 
-static void ConvergeSimilarNodes(TokenNodes &kidz)
+static bool ConvergeSimilarNodes(TokenNodes &kidz, size_t threads = 1)
 {
+	std::vector<const TokenNode *> initial_kidz(kidz.size());
+	for (size_t i = 0; i != kidz.size(); ++i) {
+		initial_kidz[i] = kidz[i].get();
+	}
+
+	bool changed = false;
 	for (;;) {
 		const size_t initial_kidz_count = kidz.size();
 		if (kidz.size() > 1) {
 			SortNodes<true>(kidz);
-			ConvergeNodesWithSimilarTokens(kidz);
+			if (ConvergeNodesWithSimilarTokens(kidz)) {
+				changed = true;
+			}
 		}
 
-		for (auto &kid : kidz) {
-			ConvergeSimilarNodes(kid->kidz);
+		// kidz subtrees are independent, so can be processed in parallel
+		if (threads > 1) {
+			const size_t kid_threads = std::max(threads / std::max(kidz.size(), (size_t)1), (size_t)1);
+			std::vector<char> kidz_changed(kidz.size());
+			ParallelFor(kidz.size(), threads, [&](size_t i) {
+				kidz_changed[i] = ConvergeKidSubtree(*kidz[i], kid_threads);
+			});
+			if (std::find(kidz_changed.begin(), kidz_changed.end(), 1) != kidz_changed.end()) {
+				changed = true;
+			}
+
+		} else for (auto &kid : kidz) {
+			if (ConvergeKidSubtree(*kid, 1)) {
+				changed = true;
+			}
 		}
 
 		if (kidz.size() > 1) {
-			ConvergeNodesWithRandomTokensAndMatchingSubnodes(kidz);
-			if (kidz.size() > 1) {
-				ConvergeNodesWithMatchingTokens(kidz);
+			if (ConvergeNodesWithRandomTokensAndMatchingSubnodes(kidz)) {
+				changed = true;
+			}
+			if (kidz.size() > 1 && ConvergeNodesWithMatchingTokens(kidz)) {
+				changed = true;
 			}
 		}
 
@@ -494,336 +1101,182 @@ static void ConvergeSimilarNodes(TokenNodes &kidz)
 			break;
 		}
 	}
-}
-
-static void TransformToStorageRepresentation(TokenNodes &kidz)
-{
-
-	// Check for tokens chains coalescion: in case of having
-	// nesting tokens chain without extra branching - merge
-	// that tokens into single one to avoid excessive storage use.
-	for (auto &kid : kidz) {
-		TransformToStorageRepresentation(kid->kidz);
-		if (kid->kidz.size() == 1 && kid->token->GetString() != nullptr
-				&& kid->kidz.front()->token->GetString() != nullptr) {
-			String merged_string = *kid->token->GetString();
-			merged_string+= *kid->kidz.front()->token->GetString();
-			kid->token.reset(new TokenString(merged_string));
-			auto tmp_subkidz = std::move(kid->kidz.front()->kidz);
-			kid->kidz = std::move(tmp_subkidz);
-		}
-	}
-
-	SortNodes<false>(kidz);
-}
 
-static void TransformToMemoryRepresentation(TokenNodes &kidz)
-{
-	// Explode chain of coalesced tokens into nested sequence 
-	// of actual tokens as needed for matching logic.
-	for (auto kidz_it = kidz.begin(); kidz_it != kidz.end(); ++kidz_it) {
-		auto &kid = *kidz_it;
-		const auto *str = kid->token->GetString();
-		if (str && str->size() > 1) {
-			StringView sv(*str);
-			const auto &head = HeadingToken(sv);
-			if (head.size() < sv.size()) {
-				std::unique_ptr<TokenString> head_token(new TokenString(head));
-				std::unique_ptr<TokenString> tail_token(new TokenString(sv.substr(head.size())));
-				TokenNodePtr new_subkid(new TokenNode);
-				new_subkid->token = std::move(tail_token);
-				new_subkid->kidz = std::move(kid->kidz);
-				kid->kidz.clear();
-				kid->kidz.emplace_back(std::move(new_subkid));
-				kid->token = std::move(head_token);
-			}
+	// if no nodes were replaced then still need to check if their order changed
+	if (!changed) {
+		for (size_t i = 0; !changed && i != kidz.size(); ++i) {
+			changed = (kidz[i].get() != initial_kidz[i]);
 		}
-
-		TransformToMemoryRepresentation(kid->kidz);
 	}
-
-	SortNodes<false>(kidz);
+	return changed;
 }
 
-static bool MatchByNodes(const StringView &value, TokenNodes &kidz)
+// Writes trie in storage representation: in case of nesting string tokens chain
+// without extra branching - that tokens are merged into single one to avoid
+// excessive storage use. Its done on the fly, so trie stays intact. Output is
+// accumulated and written to stream by big chunks. If frozen DAG made of same
+// trie given, then kidz lists shared by it are written only once, labeled by
+// '&' line, and all following occurrences are written as '*' reference lines.
+struct Saver
 {
-	if (value.size() == 0 && kidz.size() == 0) {
-		return true;
-	}
+	struct StoredNode
+	{
+		const TokenNode *head;
+		const TokenNode *tail; // last node of coalesced chain, its kidz follow this node
+		uint32_t frozen_tail; // index of tail in frozen DAG, if any
+		TokenValue merged; // used only if chain longer than single node
 
-	const StringView &head = HeadingToken(value);
-	const StringView &tail = value.substr(head.size());
-	// kidz are sorted in a way that
-	// in beginning there're string-class matchers kidz
-	// followed by exact-string matchers sorted by values
-	// 
-	// First scan string-class matchers that go in beginning
-	// checking if reached first exact-string kidz
-	// of range big enough to use binary-search optimization
-	// and if so - do it as separate phase for remaining
-	// range that contains sorted by exact-string values kidz
-	// 
-	size_t i;
-	for (i = 0; i != kidz.size(); ++i) {
-		const auto &kid = kidz[i];
-		if (i + BINSEARCH_THRESHOLD < kidz.size() && kid->token->GetString()) {
-			break; // bail out to binary search phase
-		}
-		if (kid->token->Match(head) && MatchByNodes(tail, kid->kidz)) {
-			return true;
-		}
-	}
-
-	if (i != kidz.size()) {
-		// Reached range of exact-string kidz [i .. kidz.size())
-		// lookup by upper_bound first kid that has string bigger
-		// that need to match, that means it cannot be a trailing
-		// for a needed value.
-		// Then iterate from this kid backward, as kidz that have
-		// trailing exact-strings less tham needed value are all
-		// candidates for matching sequence leaders.
-		TokenNodeSearchCmp cmp;
-		auto start = kidz.begin() + i;
-		auto kid_it = std::upper_bound(start, kidz.end(), head, cmp);
-			
-		while (kid_it != start) {
-			--kid_it;
-			if (cmp(*kid_it, head) != 0) {
-				break;
-			}
-			if (MatchByNodes(tail, (*kid_it)->kidz)) {
-				return true;
-			}
+		const TokenValue *GetString() const
+		{
+			return (tail != head) ? &merged : head->token.GetString();
 		}
-	}
-
-	return false;
-}
-
-typedef std::vector<TokenStatus> SampleStatus;
+	};
 
-struct FoundNode
-{
-	FoundNode(TokenNodes &kidz_, size_t depth_)
-		: kidz(kidz_), depth(depth_) {}
+	static constexpr uint32_t NO_LABEL = 0xffffffff;
 
-	TokenNodes &kidz;
-	size_t depth;
-};
+	OStream &os;
+	String out;
+	bool compact;
+	const Frozen *frozen;
+	std::vector<uint32_t> uses; // occurrences of frozen kidz ranges worth sharing, by their begins
+	std::vector<uint32_t> labels; // of frozen kidz ranges already written, by their begins
+	uint32_t labels_count = 0;
 
-struct FindNestedNodes : std::vector<FoundNode>
-{
-	void Lookup(TokenNodes &kidz, const StringView &token_value, size_t depth_limit)
+	Saver(OStream &os_, bool compact_, const Frozen *frozen_ = nullptr)
+		: os(os_), compact(compact_), frozen(frozen_)
 	{
-		_depth_limit = depth_limit;
-		std::vector<FoundNode>::clear();
-		for (const auto &kid : kidz) {
-			LookupRecurse(kid->kidz, token_value, 1);
+		out.reserve(SAVE_CHUNK * 2);
+		if (frozen) {
+			uses.resize(frozen->NodesCount(), 0);
+			labels.resize(frozen->NodesCount(), NO_LABEL);
+			CountUses(0);
 		}
 	}
-private:
-	size_t _depth_limit;
 
-	void LookupRecurse(TokenNodes &kidz, const StringView &token_value, size_t depth)
+	~Saver()
 	{
-		if (depth >= _depth_limit) {
-			return;
-		}
-
-		for (const auto &kid : kidz) {
-			if (kid->token->Match(token_value)) {
-				std::vector<FoundNode>::emplace_back(kid->kidz, depth);
-			}
-			LookupRecurse(kid->kidz, token_value, depth + 1);
-		}
+		os.write(out.data(), out.size());
 	}
-};
 
-class StatusByNodesContext
-{
-	// this is essentially temporary objects cache
-	// to reduce needed reallocations
-	struct FrameData
+	// single leaf is shorter than reference to it
+	bool WorthSharing(uint32_t node) const
 	{
-		SampleStatus ss;
-		FindNestedNodes fnn;
-	};
-
-	struct FramesData : std::list<FrameData> {} _frames_data;
-	typename FramesData::iterator _frames_data_top;
-	const std::chrono::time_point<std::chrono::steady_clock> _start_timepoint{std::chrono::steady_clock::now()};
-	bool _time_to_hurry = false;
-	size_t _time_to_hurry_counter = 0;
+		const auto &n = frozen->GetNode(node);
+		return n.kidz_count > 1 || (n.kidz_count == 1 && frozen->GetNode(n.kidz_begin).kidz_count != 0);
+	}
 
-public:
-	bool TimeToHurry()
+	uint32_t ChainTail(uint32_t node) const
 	{
-		// now() is quite expensive, so do some measurements decimation..
-		if (!_time_to_hurry && ++_time_to_hurry_counter > 128) {
-			_time_to_hurry_counter = 0;
-			const auto cur_timepoint = std::chrono::steady_clock::now();
-			const auto passed_seconds = std::chrono::duration_cast<std::chrono::seconds>(cur_timepoint - _start_timepoint);
-			_time_to_hurry = (passed_seconds.count() > DESCRIPT_LIMIT_TIME);
+		if (frozen->GetNode(node).kind == TK_STRING) {
+			while (frozen->GetNode(node).kidz_count == 1
+			  && frozen->GetNode(frozen->GetNode(node).kidz_begin).kind == TK_STRING) {
+				node = frozen->GetNode(node).kidz_begin;
+			}
 		}
-		return _time_to_hurry;
+		return node;
 	}
 
-	class Frame
+	// walks DAG same way as Kidz() walks trie, so ranges written more than once get labels
+	void CountUses(uint32_t parent)
 	{
-		StatusByNodesContext &_ctx;
-		typename FramesData::iterator _pos;
-	public:
-		Frame(StatusByNodesContext &ctx)
-			: _ctx(ctx)
-		{
-			if (_ctx._frames_data.empty()
-			 	|| _ctx._frames_data_top == _ctx._frames_data.end()) {
-
-				_ctx._frames_data.emplace_back();
-				_ctx._frames_data_top = _ctx._frames_data.end();
-				_ctx._frames_data_top--;
+		const auto &n = frozen->GetNode(parent);
+		for (uint32_t kid = n.kidz_begin; kid != n.kidz_begin + n.kidz_count; ++kid) {
+			const uint32_t tail = ChainTail(kid);
+			if (!WorthSharing(tail) || uses[frozen->GetNode(tail).kidz_begin]++ == 0) {
+				CountUses(tail);
 			}
-
-			_pos = _ctx._frames_data_top++;
-		}
-
-		~Frame()
-		{
-			_ctx._frames_data_top--;
-			assert(_pos == _ctx._frames_data_top);
-		}
-
-		SampleStatus &SS()
-		{
-			return _pos->ss;
-		}
-
-		FindNestedNodes &FNN()
-		{
-			return _pos->fnn;
 		}
-	};
-};
-
-template <size_t NESTING_MATCHES = 1>
-	static size_t StatusByNodes(SampleStatus &out,
-		const StringView &value, TokenNodes &kidz,
-		StatusByNodesContext &ctx)
-{
-	const size_t initial_size = out.size();
+	}
 
-	if (kidz.empty()) {
-		StringView tmp_value = value;
-		while (!tmp_value.empty()) {
-			const StringView &head = HeadingToken(tmp_value);
-			tmp_value = tmp_value.substr(head.size());
-			out.emplace_back(TS_REDUNDANT);
+	void Line(size_t depth)
+	{
+		if (compact) {
+			Tokens::AppendNumber(out, depth);
+		} else {
+			out.append(depth, ' ');
 		}
-		return out.size() - initial_size;
 	}
 
-	typename StatusByNodesContext::Frame frame(ctx);
-	SampleStatus &ss = frame.SS();
-	FindNestedNodes &fnn = frame.FNN();
-
-	size_t best_mismatches = (size_t)-1;
-	const StringView &head = HeadingToken(value);
-	const StringView &tail = value.substr(head.size());
-	// check score for head match/mismatch/missing cases
-
-	bool current_level_matched = false;
-
-	for (const auto &kid : kidz) {
-		const bool matched = kid->token->Match(head);
-		if (matched || best_mismatches > 1) {
-			ss.clear();
-			size_t mismatches = (matched ? 0 : 1);
-			if (matched) {
-				current_level_matched = true;
-				mismatches+= StatusByNodes< (NESTING_MATCHES < DESCRIPT_NESTING_MATCHES_TRH)
-								? NESTING_MATCHES + 1 : DESCRIPT_NESTING_MATCHES_TRH>
-									(ss, tail, kid->kidz, ctx);
-			} else {
-				mismatches+= StatusByNodes<0>(ss, tail, kid->kidz, ctx);
-			}
-
-			if (best_mismatches > mismatches) {
-				best_mismatches = mismatches;
-				out.resize(initial_size);
-				out.emplace_back(matched ? TS_MATCH : TS_MISMATCH);
-				out.insert(out.end(), ss.begin(), ss.end());
-				if (best_mismatches == 0) {
-					return 0;
+	// writes kidz ordered as SortNodes<false>() orders them
+	void Kidz(const TokenNodes &kidz, size_t depth, uint32_t frozen_parent = 0)
+	{
+		std::vector<StoredNode> stored(kidz.size());
+		for (size_t i = 0; i != kidz.size(); ++i) {
+			auto &sn = stored[i];
+			sn.head = sn.tail = kidz[i].get();
+			sn.frozen_tail = frozen ? frozen->GetNode(frozen_parent).kidz_begin + (uint32_t)i : 0;
+			if (sn.head->token.GetString() != nullptr) {
+				while (sn.tail->kidz.size() == 1 && sn.tail->kidz.front()->token.GetString() != nullptr) {
+					if (sn.tail == sn.head) {
+						sn.merged = *sn.head->token.GetString();
+					}
+					sn.tail = sn.tail->kidz.front().get();
+					sn.merged+= *sn.tail->token.GetString();
+					if (frozen) {
+						sn.frozen_tail = frozen->GetNode(sn.frozen_tail).kidz_begin;
+					}
 				}
 			}
 		}
-	}
-
-	// avoid time-expensive checks for redundant/missing entries if...
-	if (
-		// upper token mismatched
-		NESTING_MATCHES == 0
-
-		// lot of tokens (including current one) matched sequenctially
-		|| (NESTING_MATCHES >= DESCRIPT_NESTING_MATCHES_TRH && current_level_matched)
-
-		// definately can't find better score than 1
-		|| best_mismatches == 1
 
-		// its time to hurry up even by cost of losing exactness
-		|| ctx.TimeToHurry()) {
-
-		return best_mismatches;
-	}
-
-	if (DESCRIPT_LIMIT_MISSES != 0) {
-		// special case check: may be sample has missing some token(s)
-		fnn.Lookup(kidz, head, std::min(best_mismatches, (size_t)DESCRIPT_LIMIT_MISSES));
-
-		for (const auto &fn : fnn) if (fn.depth < best_mismatches) {
-			ss.clear();
-			const size_t mismatches = fn.depth
-				+ StatusByNodes<1>(ss, tail, fn.kidz, ctx);
-			if (best_mismatches > mismatches) {
-				best_mismatches = mismatches;
-				out.resize(initial_size);
-				out.insert(out.end(), fn.depth, TS_MISSING);
-				out.emplace_back(TS_MATCH);
-				out.insert(out.end(), ss.begin(), ss.end());
+		std::sort(stored.begin(), stored.end(), [](const StoredNode &a, const StoredNode &b) -> bool
+		{
+			const auto *astr = a.GetString();
+			const auto *bstr = b.GetString();
+			if (!!astr != !!bstr) {
+				return !!astr < !!bstr;
 			}
-		}
-	}
-
-	if (DESCRIPT_LIMIT_REDUNDANTS != 0 && !head.empty()) {
-		// special case check: may be sample has extra token(s)
-		StringView tmp_value = tail;
-		for (size_t skip_count = 1; skip_count < best_mismatches
-				&& skip_count < DESCRIPT_LIMIT_REDUNDANTS
-					&& !tmp_value.empty(); ++skip_count) {
-			const StringView &tmp_head = HeadingToken(tmp_value);
-			const StringView &tmp_tail = tmp_value.substr(tmp_head.size());
-			for (const auto &kid : kidz) {
-				if (kid->token->Match(tmp_head)) {
-					ss.clear();
-					const size_t mismatches = skip_count
-						+ StatusByNodes<1>(ss, tmp_tail, kid->kidz, ctx);
-					if (best_mismatches > mismatches) {
-						best_mismatches = mismatches;
-						out.resize(initial_size);
-						out.insert(out.end(), skip_count, TS_REDUNDANT);
-						out.emplace_back(TS_MATCH);
-						out.insert(out.end(), ss.begin(), ss.end());
-					}
+			if (astr) {
+				return *astr < *bstr;
+			}
+			return a.head->token.GetLengthMin() < b.head->token.GetLengthMin();
+		});
+
+		for (const auto &sn : stored) {
+			Line(depth);
+			if (sn.tail != sn.head) {
+				out+= '$';
+				out.append(sn.merged.data(), sn.merged.size());
+				out+= '\n';
+			} else {
+				sn.head->token.Serialize(out);
+			}
+			if (out.size() >= SAVE_CHUNK) {
+				os.write(out.data(), out.size());
+				out.clear();
+			}
+			if (frozen && WorthSharing(sn.frozen_tail)) {
+				const uint32_t range = frozen->GetNode(sn.frozen_tail).kidz_begin;
+				if (labels[range] != NO_LABEL) {
+					Line(depth + 1);
+					out+= '*';
+					Tokens::AppendNumber(out, labels[range]);
+					out+= '\n';
+					continue;
+				}
+				if (uses[range] > 1) {
+					labels[range] = labels_count++;
+					Line(depth + 1);
+					out+= '&';
+					Tokens::AppendNumber(out, labels[range]);
+					out+= '\n';
 				}
-
 			}
-			tmp_value = tmp_tail;
+			Kidz(sn.tail->kidz, depth + 1, sn.frozen_tail);
 		}
 	}
+};
 
-	return best_mismatches;
+// Loaded nodes must be ordered as in memory representation
+static void SortLoadedNodes(TokenNodes &kidz)
+{
+	for (auto &kid : kidz) {
+		SortLoadedNodes(kid->kidz);
+	}
+	SortNodes<false>(kidz);
 }
 
+typedef typename Frozen::SampleStatus SampleStatus;
 
 };
 
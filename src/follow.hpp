@@ -0,0 +1,261 @@
+#pragma once
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_FOLLOW
+#include <string>
+#include <vector>
+#include <memory>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <sys/stat.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+# include <sys/inotify.h>
+# include <poll.h>
+#endif
+
+#include "input.hpp"
+
+// Follows given files like 'tail -F' does, yielding lines appended to them.
+// Files are watched by inotify where available, otherwise (or if it fails)
+// they're polled. Each file is also reopened by path when it was rotated
+// (replaced by another file) and reread from beginning when it was truncated.
+// Yielded views are valid only until next Next() call.
+class FollowLines
+{
+	enum {
+		READ_CHUNK = 0x10000,
+		LINE_LIMIT = 0x100000, // longer lines are yielded by pieces, so memory stays bounded
+		POLL_INTERVAL_MS = 250
+	};
+
+	struct File
+	{
+		std::string path;
+		std::string buf; // read but not yet yielded data
+		size_t pos = 0;  // position of not yet yielded data in buf
+		off_t offset = 0; // position in file to read from
+		dev_t dev = 0;
+		ino_t ino = 0;
+		int fd = -1;
+
+		~File()
+		{
+			if (fd != -1) {
+				close(fd);
+			}
+		}
+	};
+
+	std::vector<std::unique_ptr<File> > _files;
+	size_t _current = 0; // index of file lines are being yielded from
+	bool _watched = false;
+#ifdef __linux__
+	int _inotify = -1;
+#endif
+
+	static bool OpenFile(File &f, bool at_end)
+	{
+		const int fd = open(f.path.c_str(), O_RDONLY);
+		if (fd == -1) {
+			return false;
+		}
+		struct stat st{};
+		if (fstat(fd, &st) != 0) {
+			close(fd);
+			return false;
+		}
+		if (f.fd != -1) {
+			close(f.fd);
+		}
+		f.fd = fd;
+		f.dev = st.st_dev;
+		f.ino = st.st_ino;
+		f.offset = at_end ? st.st_size : 0;
+		return true;
+	}
+
+	// appends available data to buffer, returns false if there was nothing to read
+	static bool ReadMore(File &f)
+	{
+		if (f.fd == -1) {
+			return false;
+		}
+		if (f.pos != 0) {
+			f.buf.erase(0, f.pos);
+			f.pos = 0;
+		}
+		const size_t prev_size = f.buf.size();
+		f.buf.resize(prev_size + READ_CHUNK);
+		ssize_t r;
+		do {
+			r = pread(f.fd, &f.buf[prev_size], READ_CHUNK, f.offset);
+		} while (r < 0 && errno == EINTR);
+		if (r < 0) {
+			f.buf.resize(prev_size);
+			throw std::runtime_error(std::string("read error: ") + strerror(errno));
+		}
+		f.buf.resize(prev_size + r);
+		f.offset+= r;
+		return r != 0;
+	}
+
+	// yields complete line or too long piece of it from buffer
+	static bool NextBuffered(File &f, InputLineView &line)
+	{
+		const char *data = f.buf.data();
+		const char *eol = (const char *)memchr(data + f.pos, '\n', f.buf.size() - f.pos);
+		size_t len;
+		if (eol) {
+			len = eol - (data + f.pos);
+
+		} else if (f.buf.size() - f.pos >= LINE_LIMIT) {
+			len = LINE_LIMIT;
+
+		} else {
+			return false;
+		}
+		line = InputLineView(data + f.pos, len);
+		f.pos+= eol ? len + 1 : len;
+		return true;
+	}
+
+	// reopens rotated file and rewinds truncated one, returns true if did something
+	static bool CheckReplaced(File &f)
+	{
+		struct stat st{};
+		if (stat(f.path.c_str(), &st) == 0 && (f.fd == -1 || st.st_dev != f.dev || st.st_ino != f.ino)) {
+			if (ReadMore(f)) { // something written to old file before its rotation
+				return true;
+			}
+			// old file fully read at this point, so its unfinished line is complete
+			if (OpenFile(f, false)) {
+				if (f.pos != f.buf.size()) {
+					f.buf+= '\n';
+				}
+				return true;
+			}
+		}
+		if (f.fd != -1 && fstat(f.fd, &st) == 0 && st.st_size < f.offset) {
+			f.buf.clear();
+			f.pos = 0;
+			f.offset = 0;
+			return true;
+		}
+		return false;
+	}
+
+	void Watch()
+	{
+		_watched = true;
+#ifdef __linux__
+		_inotify = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (_inotify == -1) {
+			return;
+		}
+		for (const auto &f : _files) {
+			// watch directory to be notified also about rotation of file
+			const size_t slash = f->path.rfind('/');
+			const std::string dir = (slash == std::string::npos) ? "."
+				: (slash == 0) ? "/" : f->path.substr(0, slash);
+			if (inotify_add_watch(_inotify, dir.c_str(), IN_MODIFY | IN_CREATE
+			  | IN_MOVED_TO | IN_MOVED_FROM | IN_DELETE | IN_ATTRIB) == -1) {
+				close(_inotify);
+				_inotify = -1;
+				return;
+			}
+		}
+#endif
+	}
+
+	// waits for some changes, or just for polling interval if cant be notified
+	void Wait()
+	{
+#ifdef __linux__
+		if (_inotify != -1) {
+			struct pollfd pfd{_inotify, POLLIN, 0};
+			if (poll(&pfd, 1, POLL_INTERVAL_MS) > 0) {
+				char events[0x1000];
+				while (read(_inotify, events, sizeof(events)) > 0) {
+					;
+				}
+			}
+			return;
+		}
+#endif
+		usleep(POLL_INTERVAL_MS * 1000);
+	}
+
+public:
+	FollowLines() = default;
+	FollowLines(const FollowLines &) = delete;
+
+	~FollowLines()
+	{
+#ifdef __linux__
+		if (_inotify != -1) {
+			close(_inotify);
+		}
+#endif
+	}
+
+	/// Starts following given file from its current end, returns false if failed to open it
+	bool Open(const char *path)
+	{
+		std::unique_ptr<File> f(new File);
+		f->path = path;
+		if (!OpenFile(*f, true)) {
+			return false;
+		}
+		_files.emplace_back(std::move(f));
+		return true;
+	}
+
+	size_t Count() const
+	{
+		return _files.size();
+	}
+
+	/// Index of file (in order of opening) that last yielded line belongs to
+	size_t Index() const
+	{
+		return _current;
+	}
+
+	const std::string &Path(size_t index) const
+	{
+		return _files[index]->path;
+	}
+
+	/// Waits for next appended line and yields it without trailing newline,
+	/// returns false only if nothing opened
+	bool Next(InputLineView &line)
+	{
+		if (_files.empty()) {
+			return false;
+		}
+		if (!_watched) {
+			Watch();
+		}
+		for (;;) {
+			// drain current file before others, so its lines go contiguously
+			for (size_t i = 0; i != _files.size(); ++i, _current = (_current + 1) % _files.size()) {
+				File &f = *_files[_current];
+				do {
+					if (NextBuffered(f, line)) {
+						return true;
+					}
+				} while (ReadMore(f));
+			}
+			bool changed = false;
+			for (auto &f : _files) {
+				changed|= CheckReplaced(*f);
+			}
+			if (!changed) {
+				Wait();
+			}
+		}
+	}
+};
+#endif
@@ -0,0 +1,937 @@
+#pragma once
+#include "tokenizer.hpp"
+#include <stdint.h>
+#include <string.h>
+#include <vector>
+#include <unordered_map>
+#include <algorithm>
+#include <ostream>
+#include <stdexcept>
+
+// Read-only compact representation of learned trie intended for fast matching:
+// all nodes are placed in single array, each node's kidz occupy contiguous
+// range of that array (optionally shared by parents having identical kidz)
+// and tokens' strings are stored in single shared pool.
+// Matching walks it without virtual calls and without chasing pointers.
+// Same layout used as binary trie file format, so it can be matched directly
+// in memory where that file is mapped to.
+template <class String, class StringView, class Tokens>
+	struct AutoPatternsFrozen : AutoPatternsTokenizer
+{
+enum {
+	BINSEARCH_THRESHOLD = 10,
+	HASH_THRESHOLD = 32
+};
+
+static constexpr uint32_t LENGTH_UNLIMITED = 0xffffffff;
+static constexpr uint32_t SLOT_EMPTY = 0xffffffff;
+
+typedef typename String::value_type CharT;
+typedef typename Tokens::Node TokenNode;
+typedef typename Tokens::TokenString TokenString;
+typedef typename Tokens::TokenStringClass TokenStringClass;
+typedef typename Tokens::TokenStringWithNumbers TokenStringWithNumbers;
+typedef typename Tokens::TokenValue TokenValue;
+typedef std::basic_ostream<CharT> OStream;
+typedef Tokenized<StringView> TokenizedSample;
+
+static const char *BinaryIdentity()
+{
+	return "AutoPatternsTrieBin:2\n";
+}
+
+struct Node
+{
+	uint32_t kidz_begin = 0;   // index of first kid in nodes array
+	uint32_t kidz_count = 0;
+	uint32_t kidz_classes = 0; // amount of leading class-matching kidz, exact-string kidz follow them sorted by value
+	uint32_t str_offset = 0;   // exact string value or numbers-sequence in strings pool
+	uint32_t str_size = 0;
+	uint32_t min_len = 0;
+	uint32_t max_len = LENGTH_UNLIMITED;
+	StringClass sc = SCF_INVALID;
+	uint32_t slots_begin = 0;  // hash table of exact-string kidz in slots array, if slots_bits != 0
+	TokenKind kind = TK_STRING;
+	unsigned char slots_bits = 0; // log2 of hash table size
+	unsigned char reserved[2] {}; // explicit padding to keep binary file content defined
+};
+
+// binary file starts with this header followed by nodes array, slots array and then by strings pool
+struct BinaryHeader
+{
+	char identity[24];
+	uint32_t byte_order;
+	uint32_t node_size;
+	uint32_t char_size;
+	uint32_t nodes_count;
+	uint32_t slots_count;
+	uint32_t reserved;
+	uint64_t pool_size;
+};
+
+static constexpr uint32_t BINARY_BYTE_ORDER = 0x01020304;
+
+bool Valid() const
+{
+	return _nodes_count != 0;
+}
+
+size_t NodesCount() const
+{
+	return _nodes_count;
+}
+
+void Clear()
+{
+	_nodes.clear();
+	_slots.clear();
+	_pool.clear();
+	_nodes_ptr = nullptr;
+	_nodes_count = 0;
+	_slots_ptr = nullptr;
+	_slots_count = 0;
+	_pool_ptr = nullptr;
+	_pool_size = 0;
+	_depths.clear();
+}
+
+/// Builds from given tree. If share_subtrees set then structurally identical kidz
+/// lists are placed only once and referred by all their parents, making DAG.
+void Build(const TokenNode &root, bool share_subtrees = false)
+{
+	Clear();
+	_nodes.emplace_back();
+	if (share_subtrees) {
+		BuildShared(root);
+	} else {
+		BuildKidz(0, root);
+	}
+	_nodes_ptr = _nodes.data();
+	_nodes_count = _nodes.size();
+	_slots_ptr = _slots.data();
+	_slots_count = _slots.size();
+	_pool_ptr = _pool.data();
+	_pool_size = _pool.size();
+	BuildDepths();
+}
+
+static bool IsBinary(const void *data, size_t size)
+{
+	return size >= sizeof(BinaryHeader)
+		&& memcmp(data, BinaryIdentity(), strlen(BinaryIdentity())) == 0;
+}
+
+/// Makes this instance to use given memory with SaveBinary()'ed content
+/// without copying it, so that memory must outlive this instance.
+void Attach(const void *data, size_t size)
+{
+	Clear();
+	if (!IsBinary(data, size)) {
+		throw std::runtime_error("bad binary trie identity");
+	}
+	if ((((uintptr_t)data) % alignof(Node)) != 0) {
+		throw std::runtime_error("binary trie misaligned in memory");
+	}
+	const BinaryHeader &hdr = *(const BinaryHeader *)data;
+	if (hdr.byte_order != BINARY_BYTE_ORDER || hdr.node_size != sizeof(Node) || hdr.char_size != sizeof(CharT)) {
+		throw std::runtime_error("binary trie made on incompatible platform");
+	}
+	size_t avail = size - sizeof(BinaryHeader);
+	if (hdr.nodes_count == 0 || avail / sizeof(Node) < hdr.nodes_count
+	  || (avail - hdr.nodes_count * sizeof(Node)) / sizeof(uint32_t) < hdr.slots_count
+	  || (avail - hdr.nodes_count * sizeof(Node) - hdr.slots_count * sizeof(uint32_t)) / sizeof(CharT) < hdr.pool_size) {
+		throw std::runtime_error("binary trie truncated");
+	}
+
+	const Node *nodes = (const Node *)(((const char *)data) + sizeof(BinaryHeader));
+	const uint32_t *slots = (const uint32_t *)(nodes + hdr.nodes_count);
+	for (size_t i = 0; i != hdr.nodes_count; ++i) {
+		const Node &n = nodes[i];
+		if (n.kidz_begin > hdr.nodes_count || hdr.nodes_count - n.kidz_begin < n.kidz_count
+		  || n.kidz_classes > n.kidz_count || (n.kidz_count != 0 && n.kidz_begin <= i)
+		  || n.str_offset > hdr.pool_size || hdr.pool_size - n.str_offset < n.str_size
+		  || n.kind > TK_STRING_WITH_NUMBERS || n.slots_bits >= 32) {
+			throw std::runtime_error("binary trie corrupted");
+		}
+		if (n.slots_bits) {
+			const uint32_t slots_size = ((uint32_t)1) << n.slots_bits;
+			if (n.slots_begin > hdr.slots_count || hdr.slots_count - n.slots_begin < slots_size) {
+				throw std::runtime_error("binary trie corrupted");
+			}
+			for (uint32_t j = n.slots_begin; j != n.slots_begin + slots_size; ++j) {
+				if (slots[j] != SLOT_EMPTY && (slots[j] < n.kidz_begin + n.kidz_classes
+				  || slots[j] >= n.kidz_begin + n.kidz_count)) {
+					throw std::runtime_error("binary trie corrupted");
+				}
+			}
+		}
+	}
+
+	_nodes_ptr = nodes;
+	_nodes_count = hdr.nodes_count;
+	_slots_ptr = slots;
+	_slots_count = hdr.slots_count;
+	_pool_ptr = (const CharT *)(slots + hdr.slots_count);
+	_pool_size = hdr.pool_size;
+	BuildDepths();
+}
+
+void SaveBinary(OStream &os) const
+{
+	BinaryHeader hdr{};
+	strncpy(hdr.identity, BinaryIdentity(), sizeof(hdr.identity));
+	hdr.byte_order = BINARY_BYTE_ORDER;
+	hdr.node_size = sizeof(Node);
+	hdr.char_size = sizeof(CharT);
+	hdr.nodes_count = (uint32_t)_nodes_count;
+	hdr.slots_count = (uint32_t)_slots_count;
+	hdr.pool_size = _pool_size;
+	static_assert(sizeof(hdr) % sizeof(CharT) == 0 && sizeof(Node) % sizeof(CharT) == 0
+		&& sizeof(uint32_t) % sizeof(CharT) == 0, "binary trie parts sizes must be multiple of char size");
+	os.write((const CharT *)&hdr, sizeof(hdr) / sizeof(CharT));
+	os.write((const CharT *)_nodes_ptr, (_nodes_count * sizeof(Node)) / sizeof(CharT));
+	os.write((const CharT *)_slots_ptr, (_slots_count * sizeof(uint32_t)) / sizeof(CharT));
+	os.write(_pool_ptr, _pool_size);
+}
+
+/// Recreates tokens tree from this representation
+void Thaw(TokenNode &root) const
+{
+	root.kidz.clear();
+	ThawKidz(root, _nodes_ptr[0]);
+}
+
+bool Match(const TokenizedSample &ts) const
+{
+	return MatchKidz<false>(_nodes_ptr[0], ts, 0, nullptr);
+}
+
+/// Same as Match() but on success also fills path with indices of nodes matched by sample's tokens
+bool Match(const TokenizedSample &ts, std::vector<uint32_t> &path) const
+{
+	path.resize(ts.size());
+	return MatchKidzPath(_nodes_ptr[0], ts, 0, path.data());
+}
+
+const Node &GetNode(uint32_t index) const
+{
+	return _nodes_ptr[index];
+}
+
+/// Returns true if given node matches tokens only by their length and class, so tokens
+/// differing just by decimal digits match it as long as those digits dont change their class
+bool MatchesAnyDigits(uint32_t node) const
+{
+	return _nodes_ptr[node].kind == TK_STRING_CLASS && (_nodes_ptr[node].sc & SCF_RANDOM) == 0;
+}
+
+/// Matches count samples at once setting results of matched ones to 1 and others to 0.
+/// Samples are grouped by common heading tokens, so each group walks its path once.
+void Match(const TokenizedSample *samples, size_t count, char *results) const
+{
+	std::vector<uint32_t> order(count);
+	for (size_t i = 0; i != count; ++i) {
+		order[i] = (uint32_t)i;
+		results[i] = 0;
+	}
+	// sorting by lines makes ones with common heading tokens mostly adjacent
+	std::sort(order.begin(), order.end(), [samples](uint32_t a, uint32_t b) {
+		return samples[a].line < samples[b].line;
+	});
+	MatchGroup(_nodes_ptr[0], samples, order.data(), order.data() + count, 0, results);
+}
+
+typedef std::vector<TokenStatus> SampleStatus;
+
+/// Finds trie path closest to given sample - one with minimal total amount of
+/// mismatched, redundant (absent in trie) and missing (absent in sample) tokens.
+/// Fills out with statuses of that path steps and returns that amount.
+/// Its A* search over (node, token index) states visiting each state at most
+/// once, so result is exact and deterministic and time is bounded by amount
+/// of nodes multiplied by amount of tokens.
+/// If amount of reached states exceeds given budget then search stops, sets
+/// exhausted and result is composed from closest found states continued greedily,
+/// so its still deterministic but may be not the best.
+size_t Descript(SampleStatus &out, const TokenizedSample &ts, size_t budget, bool &exhausted) const
+{
+	exhausted = false;
+
+	// Path of deepest partial match continued greedily gives upper bound of cost
+	// to prune search with, and if its single difference then its the best one
+	// as sample doesn't match at all. Usually anomalies are like that.
+	MatchPoint deepest;
+	const bool matched = MatchKidz<true>(_nodes_ptr[0], ts, 0, &deepest);
+	SampleStatus seed(deepest.index, TS_MATCH);
+	const size_t seed_cost = DescriptGreedy(&seed, deepest.node, deepest.index, ts);
+	if (!matched && seed_cost <= 1) {
+		out.swap(seed);
+		return seed_cost;
+	}
+
+	DescriptSearch ds(*this, ts.size(), matched ? (size_t)-1 : seed_cost);
+	ds.Reach(0, 0, 0, DescriptSearch::NO_STEP, TS_MATCH);
+	for (uint32_t estimate = 0; estimate < ds.queue.size(); ++estimate) {
+		// steps that don't increase estimate append to same queue while its being walked
+		for (size_t i = 0; i < ds.queue[estimate].size(); ++i) {
+			if (ds.steps.size() > budget) {
+				exhausted = true;
+				const size_t cost = DescriptClosest(out, ds, ts);
+				if (cost < seed_cost) {
+					return cost;
+				}
+				out.swap(seed);
+				return seed_cost;
+			}
+			const uint32_t step_index = ds.queue[estimate][i];
+			auto &step = ds.steps[step_index];
+			if (step.expanded) {
+				continue; // reached again by cheaper path before
+			}
+			step.expanded = true;
+			const uint32_t node = step.node, index = step.index, cost = step.cost;
+			const Node &n = _nodes_ptr[node];
+			if (n.kidz_count == 0 && index == ts.size()) {
+				ds.Result(out, step_index);
+				return cost;
+			}
+			uint32_t &closest = ds.closest[index];
+			if (closest == DescriptSearch::NO_STEP || ds.steps[closest].cost > cost) {
+				closest = step_index;
+			}
+
+			const Node *kidz = _nodes_ptr + n.kidz_begin;
+			if (index < ts.size()) {
+				const StringView &head = ts.Token(index);
+				for (uint32_t k = 0; k != n.kidz_count; ++k) {
+					if (MatchToken(kidz[k], ts, index, head)) {
+						ds.Reach(n.kidz_begin + k, index + 1, cost, step_index, TS_MATCH);
+					}
+				}
+				for (uint32_t k = 0; k != n.kidz_count; ++k) {
+					ds.Reach(n.kidz_begin + k, index + 1, cost + 1, step_index, TS_MISMATCH);
+				}
+			}
+			for (uint32_t k = 0; k != n.kidz_count; ++k) {
+				ds.Reach(n.kidz_begin + k, index, cost + 1, step_index, TS_MISSING);
+			}
+			if (index < ts.size()) {
+				ds.Reach(node, index + 1, cost + 1, step_index, TS_REDUNDANT);
+			}
+		}
+	}
+
+	// nothing cheaper than seed
+	out.swap(seed);
+	return seed_cost;
+}
+
+private:
+// amounts of tokens from node to its nearest and farthest leaf
+struct Depths
+{
+	uint32_t min;
+	uint32_t max;
+};
+
+std::vector<Node> _nodes;
+std::vector<uint32_t> _slots; // indices of first exact-string kidz with given value or SLOT_EMPTY
+String _pool;
+std::vector<Depths> _depths; // of each node, used by Descript() to estimate remaining cost
+
+// either point to _nodes, _slots and _pool either to attached memory
+const Node *_nodes_ptr = nullptr;
+size_t _nodes_count = 0;
+const uint32_t *_slots_ptr = nullptr;
+size_t _slots_count = 0;
+const CharT *_pool_ptr = nullptr;
+size_t _pool_size = 0;
+
+// kidz always placed after their parent, so walking nodes backward meets kidz first
+void BuildDepths()
+{
+	_depths.resize(_nodes_count);
+	for (size_t i = _nodes_count; i-- > 0;) {
+		const Node &n = _nodes_ptr[i];
+		Depths &d = _depths[i];
+		if (n.kidz_count == 0) {
+			d.min = d.max = 0;
+			continue;
+		}
+		d.min = 0xffffffff;
+		d.max = 0;
+		for (uint32_t k = n.kidz_begin; k != n.kidz_begin + n.kidz_count; ++k) {
+			d.min = std::min(d.min, _depths[k].min + 1);
+			d.max = std::max(d.max, _depths[k].max + 1);
+		}
+	}
+}
+
+// Lower bound of cost to reach some leaf from given node having given amount
+// of sample tokens remaining - as each token may fill at most one trie level
+inline uint32_t EstimateCost(uint32_t node, size_t remain) const
+{
+	const Depths &d = _depths[node];
+	if (remain < d.min) {
+		return d.min - remain;
+	}
+	return (remain > d.max) ? uint32_t(remain - d.max) : 0;
+}
+
+// Descript() search states and queues of their indices by estimated total cost,
+// that never decreases along path as EstimateCost() decreases at most by step cost
+struct DescriptSearch
+{
+	enum : uint32_t { NO_STEP = 0xffffffff };
+
+	struct Step
+	{
+		uint32_t node;
+		uint32_t index;
+		uint32_t cost;
+		uint32_t prev;      // step this one reached from
+		TokenStatus status; // status of token passed by reaching this step
+		bool expanded;
+	};
+
+	std::vector<Step> steps;
+	std::vector<std::vector<uint32_t> > queue;
+	std::vector<uint32_t> closest; // cheapest expanded step of each token index
+	const AutoPatternsFrozen &frozen;
+	const uint32_t tokens;
+	const size_t bound; // cost of already known path, so only cheaper ones are searched
+
+	DescriptSearch(const AutoPatternsFrozen &frozen_, size_t tokens_, size_t bound_)
+		: closest(tokens_ + 1, NO_STEP), frozen(frozen_), tokens((uint32_t)tokens_), bound(bound_) { }
+
+	void Reach(uint32_t node, uint32_t index, uint32_t cost, uint32_t prev, TokenStatus status)
+	{
+		const uint32_t estimate = cost + frozen.EstimateCost(node, tokens - index);
+		if (estimate >= bound) {
+			return;
+		}
+		uint32_t &slot = Slot(node, index);
+		if (slot == NO_STEP) {
+			slot = (uint32_t)steps.size();
+			steps.emplace_back(Step{node, index, cost, prev, status, false});
+
+		} else {
+			auto &step = steps[slot];
+			if (step.cost <= cost) {
+				return;
+			}
+			// cost-free step may lead to state that already reached at higher cost
+			step.cost = cost;
+			step.prev = prev;
+			step.status = status;
+		}
+		if (queue.size() <= estimate) {
+			queue.resize(estimate + 1);
+		}
+		queue[estimate].emplace_back(slot);
+	}
+
+	void Result(SampleStatus &out, uint32_t last)
+	{
+		out.clear();
+		for (uint32_t i = last; steps[i].prev != NO_STEP; i = steps[i].prev) {
+			out.emplace_back(steps[i].status);
+		}
+		std::reverse(out.begin(), out.end());
+	}
+
+private:
+	std::vector<uint32_t> _table; // open addressing hash table of steps by their states
+
+	size_t Position(uint32_t node, uint32_t index) const
+	{
+		const uint64_t key = (uint64_t)node * (tokens + 1) + index;
+		return (size_t)((key * 0x9e3779b97f4a7c15ull) >> 32) & (_table.size() - 1);
+	}
+
+	uint32_t &Slot(uint32_t node, uint32_t index)
+	{
+		if ((steps.size() + 1) * 2 > _table.size()) {
+			_table.assign(std::max(_table.size() * 2, (size_t)1024), NO_STEP);
+			for (uint32_t i = 0; i != (uint32_t)steps.size(); ++i) {
+				size_t pos = Position(steps[i].node, steps[i].index);
+				while (_table[pos] != NO_STEP) {
+					pos = (pos + 1) & (_table.size() - 1);
+				}
+				_table[pos] = i;
+			}
+		}
+		for (size_t pos = Position(node, index); ; pos = (pos + 1) & (_table.size() - 1)) {
+			uint32_t &slot = _table[pos];
+			if (slot == NO_STEP || (steps[slot].node == node && steps[slot].index == index)) {
+				return slot;
+			}
+		}
+	}
+};
+
+// Finishes Descript() that exhausted its budget: among cheapest expanded
+// states of each token index picks one that gives best greedy continuation.
+// Returns (size_t)-1 leaving out untouched if nothing was expanded.
+size_t DescriptClosest(SampleStatus &out, DescriptSearch &ds, const TokenizedSample &ts) const
+{
+	size_t best_cost = (size_t)-1;
+	uint32_t best_step = DescriptSearch::NO_STEP;
+	for (size_t index = ts.size() + 1; index-- > 0;) {
+		const uint32_t step_index = ds.closest[index];
+		if (step_index != DescriptSearch::NO_STEP) {
+			const auto &step = ds.steps[step_index];
+			const size_t cost = step.cost + DescriptGreedy(nullptr, step.node, index, ts);
+			if (best_cost > cost) {
+				best_cost = cost;
+				best_step = step_index;
+			}
+		}
+	}
+	if (best_step != DescriptSearch::NO_STEP) {
+		ds.Result(out, best_step);
+		DescriptGreedy(&out, ds.steps[best_step].node, ds.steps[best_step].index, ts);
+	}
+	return best_cost;
+}
+
+// Continues path from given state to some leaf choosing at each level kid
+// that matches current token and has least estimate of remaining cost,
+// appends statuses of passed steps to out if its not null and returns their cost
+size_t DescriptGreedy(SampleStatus *out, uint32_t node, size_t index, const TokenizedSample &ts) const
+{
+	size_t cost = 0;
+	for (;;) {
+		const Node &n = _nodes_ptr[node];
+		if (n.kidz_count == 0) {
+			if (out) {
+				out->insert(out->end(), ts.size() - index, TS_REDUNDANT);
+			}
+			return cost + (ts.size() - index);
+		}
+		const bool tail = (index < ts.size());
+		const StringView &head = ts.Token(index);
+		size_t best_estimate = (size_t)-1;
+		TokenStatus best_status = TS_MISSING;
+		for (uint32_t k = n.kidz_begin; k != n.kidz_begin + n.kidz_count; ++k) {
+			const TokenStatus status = !tail ? TS_MISSING
+				: MatchToken(_nodes_ptr[k], ts, index, head) ? TS_MATCH : TS_MISMATCH;
+			const size_t estimate = (status != TS_MATCH ? 1 : 0)
+				+ EstimateCost(k, ts.size() - index - (tail ? 1 : 0));
+			if (best_estimate > estimate) {
+				best_estimate = estimate;
+				best_status = status;
+				node = k;
+			}
+		}
+		if (out) {
+			out->emplace_back(best_status);
+		}
+		if (best_status != TS_MATCH) {
+			++cost;
+		}
+		if (tail) {
+			++index;
+		}
+	}
+}
+
+static uint32_t NarrowLength(size_t len)
+{
+	return (len < LENGTH_UNLIMITED) ? (uint32_t)len : LENGTH_UNLIMITED;
+}
+
+uint32_t PoolString(const TokenValue &str)
+{
+	if (_pool.size() + str.size() >= LENGTH_UNLIMITED) {
+		throw std::runtime_error("Frozen trie strings pool overflow");
+	}
+	const uint32_t out = (uint32_t)_pool.size();
+	_pool.append(str.data(), str.size());
+	return out;
+}
+
+void BuildToken(Node &n, const typename Tokens::Token &token)
+{
+	n.kind = token.Kind();
+	if (n.kind == TK_STRING_CLASS) {
+		n.sc = token.GetStringClass();
+	}
+	n.min_len = NarrowLength(token.GetLengthMin());
+	n.max_len = NarrowLength(token.GetLengthMax());
+	const TokenValue *str = nullptr;
+	switch (n.kind) {
+		case TK_STRING:
+			str = token.GetString();
+			break;
+		case TK_STRING_WITH_NUMBERS:
+			str = &token.GetSequence();
+			break;
+		default:
+			;
+	}
+	if (str) {
+		n.str_offset = PoolString(*str);
+		n.str_size = (uint32_t)str->size();
+	}
+}
+
+static uint32_t KidzClasses(const TokenNode &tn)
+{
+	uint32_t out = 0;
+	for (size_t i = 0; i != tn.kidz.size(); ++i) {
+		if (tn.kidz[i]->token.Kind() != TK_STRING) {
+			out = (uint32_t)(i + 1);
+		}
+	}
+	return out;
+}
+
+void BuildKidz(size_t index, const TokenNode &tn)
+{
+	if (_nodes.size() + tn.kidz.size() >= LENGTH_UNLIMITED) {
+		throw std::runtime_error("Frozen trie nodes overflow");
+	}
+
+	// allocate all kidz at once to keep them contiguous
+	const uint32_t kidz_begin = (uint32_t)_nodes.size();
+	_nodes.resize(_nodes.size() + tn.kidz.size());
+	_nodes[index].kidz_begin = kidz_begin;
+	_nodes[index].kidz_count = (uint32_t)tn.kidz.size();
+	_nodes[index].kidz_classes = KidzClasses(tn);
+	for (size_t i = 0; i != tn.kidz.size(); ++i) {
+		BuildToken(_nodes[kidz_begin + i], tn.kidz[i]->token);
+	}
+	BuildSlots(index);
+
+	for (size_t i = 0; i != tn.kidz.size(); ++i) {
+		BuildKidz(kidz_begin + i, *tn.kidz[i]);
+	}
+}
+
+// Distinct kidz lists of tree: two lists are same if they have equal tokens whose
+// kidz are same lists, so each list is interned after its kidz lists and comparing
+// doesn't need to descend deeper. Thus lists ids are in post-order: any list has
+// bigger id than lists of its kidz.
+struct SharedLists
+{
+	struct List
+	{
+		const TokenNode *owner; // node which kidz make this list
+		std::vector<uint32_t> kidz_lists; // ids of lists of each kid
+	};
+
+	std::vector<List> lists;
+	std::unordered_multimap<size_t, uint32_t> index; // ids of lists by their hashes
+
+	uint32_t Intern(const TokenNode &tn)
+	{
+		std::vector<uint32_t> kidz_lists(tn.kidz.size());
+		size_t hash = tn.kidz.size();
+		for (size_t i = 0; i != tn.kidz.size(); ++i) {
+			kidz_lists[i] = Intern(*tn.kidz[i]);
+			hash = (hash * 1000003) ^ (tn.kidz[i]->token.Hash() * 31 + kidz_lists[i]);
+		}
+		const auto &range = index.equal_range(hash);
+		for (auto it = range.first; it != range.second; ++it) {
+			const List &l = lists[it->second];
+			if (l.kidz_lists == kidz_lists && TokensEqual(l.owner->kidz, tn.kidz)) {
+				return it->second;
+			}
+		}
+		if (lists.size() >= LENGTH_UNLIMITED) {
+			throw std::runtime_error("Frozen trie nodes overflow");
+		}
+		const uint32_t id = (uint32_t)lists.size();
+		lists.emplace_back(List{&tn, std::move(kidz_lists)});
+		index.emplace(hash, id);
+		return id;
+	}
+
+	static bool TokensEqual(const typename Tokens::Nodes &a, const typename Tokens::Nodes &b)
+	{
+		for (size_t i = 0; i != a.size(); ++i) {
+			if (!a[i]->token.Equals(b[i]->token)) {
+				return false;
+			}
+		}
+		return true;
+	}
+};
+
+// Same as BuildKidz() but places each distinct kidz list once. Lists are placed
+// in reverse post-order, so kidz still always placed after all their parents.
+void BuildShared(const TokenNode &root)
+{
+	SharedLists sl;
+	const uint32_t root_list = sl.Intern(root);
+
+	std::vector<uint32_t> begins(sl.lists.size());
+	size_t count = _nodes.size();
+	for (uint32_t id = root_list + 1; id-- > 0;) {
+		begins[id] = (uint32_t)count;
+		count+= sl.lists[id].owner->kidz.size();
+		if (count >= LENGTH_UNLIMITED) {
+			throw std::runtime_error("Frozen trie nodes overflow");
+		}
+	}
+	_nodes.resize(count);
+
+	std::vector<uint32_t> slots_of(sl.lists.size(), SLOT_EMPTY); // parent that has slots of list
+	const auto &link = [&](uint32_t index, uint32_t list) {
+		const TokenNode &owner = *sl.lists[list].owner;
+		Node &n = _nodes[index];
+		n.kidz_begin = begins[list];
+		n.kidz_count = (uint32_t)owner.kidz.size();
+		n.kidz_classes = KidzClasses(owner);
+		if (slots_of[list] == SLOT_EMPTY) {
+			BuildSlots(index);
+			slots_of[list] = index;
+		} else {
+			n.slots_begin = _nodes[slots_of[list]].slots_begin;
+			n.slots_bits = _nodes[slots_of[list]].slots_bits;
+		}
+	};
+
+	// slots refer to tokens values, so they're built only when all tokens in place
+	for (uint32_t id = 0; id != sl.lists.size(); ++id) {
+		const auto &kidz = sl.lists[id].owner->kidz;
+		for (size_t i = 0; i != kidz.size(); ++i) {
+			BuildToken(_nodes[begins[id] + i], kidz[i]->token);
+		}
+	}
+	link(0, root_list);
+	for (uint32_t id = 0; id != sl.lists.size(); ++id) {
+		const auto &kidz_lists = sl.lists[id].kidz_lists;
+		for (size_t i = 0; i != kidz_lists.size(); ++i) {
+			link(begins[id] + (uint32_t)i, kidz_lists[i]);
+		}
+	}
+}
+
+// makes hash table of exact-string kidz for wide nodes, kidz with
+// same value are adjacent, so table refers only first of them
+void BuildSlots(size_t index)
+{
+	const Node &n = _nodes[index];
+	const uint32_t strings_count = n.kidz_count - n.kidz_classes;
+	if (strings_count <= HASH_THRESHOLD) {
+		return;
+	}
+	unsigned char bits = 1;
+	while ((((uint32_t)1) << bits) < strings_count * 2) {
+		++bits;
+	}
+	const uint32_t slots_size = ((uint32_t)1) << bits;
+	if (_slots.size() + slots_size >= LENGTH_UNLIMITED) {
+		throw std::runtime_error("Frozen trie slots overflow");
+	}
+	const uint32_t slots_begin = (uint32_t)_slots.size();
+	_slots.resize(_slots.size() + slots_size, (uint32_t)SLOT_EMPTY);
+	uint32_t *slots = &_slots[slots_begin];
+	const StringView pool(_pool.data(), _pool.size());
+	const auto &kid_string = [&](uint32_t kid) {
+		return pool.substr(_nodes[kid].str_offset, _nodes[kid].str_size);
+	};
+	for (uint32_t kid = n.kidz_begin + n.kidz_classes; kid != n.kidz_begin + n.kidz_count; ++kid) {
+		if (kid != n.kidz_begin + n.kidz_classes && kid_string(kid - 1) == kid_string(kid)) {
+			continue;
+		}
+		uint32_t i = HashString(kid_string(kid)) & (slots_size - 1);
+		while (slots[i] != SLOT_EMPTY) {
+			i = (i + 1) & (slots_size - 1);
+		}
+		slots[i] = kid;
+	}
+	_nodes[index].slots_begin = slots_begin;
+	_nodes[index].slots_bits = bits;
+}
+
+// returns first exact-string kid with given value or nullptr if no such kid
+const Node *LookupSlot(const Node &parent, const StringView &head) const
+{
+	const uint32_t *slots = _slots_ptr + parent.slots_begin;
+	const uint32_t slots_size = ((uint32_t)1) << parent.slots_bits;
+	for (uint32_t i = HashString(head) & (slots_size - 1), probes = slots_size; probes; --probes) {
+		if (slots[i] == SLOT_EMPTY) {
+			break;
+		}
+		const Node *kid = _nodes_ptr + slots[i];
+		if (kid->str_size == head.size() && NodeString(*kid) == head) {
+			return kid;
+		}
+		i = (i + 1) & (slots_size - 1);
+	}
+	return nullptr;
+}
+
+inline StringView NodeString(const Node &n) const
+{
+	return StringView(_pool_ptr + n.str_offset, n.str_size);
+}
+
+void ThawKidz(TokenNode &tn, const Node &n) const
+{
+	tn.kidz.reserve(n.kidz_count);
+	for (const Node *kid = _nodes_ptr + n.kidz_begin, *end = kid + n.kidz_count; kid != end; ++kid) {
+		tn.kidz.emplace_back(new TokenNode);
+		tn.kidz.back()->dirty = false; // frozen trie made of converged one
+		auto &token = tn.kidz.back()->token;
+		const size_t max_len = (kid->max_len == LENGTH_UNLIMITED) ? (size_t)-1 : kid->max_len;
+		switch (kid->kind) {
+			case TK_STRING:
+				token = TokenString(NodeString(*kid));
+				break;
+
+			case TK_STRING_CLASS:
+				token = TokenStringClass(kid->sc, kid->min_len, max_len);
+				break;
+
+			case TK_STRING_WITH_NUMBERS:
+				token = TokenStringWithNumbers(NodeString(*kid), max_len, true);
+				break;
+		}
+		ThawKidz(*tn.kidz.back(), *kid);
+	}
+}
+
+inline bool MatchToken(const Node &n, const TokenizedSample &ts, size_t index, const StringView &value) const
+{
+	switch (n.kind) {
+		case TK_STRING:
+			return value.size() == n.str_size && value == NodeString(n);
+
+		case TK_STRING_CLASS:
+			return value.size() >= n.min_len && value.size() <= n.max_len
+				&& StringFitsClass(value, ts.TokenClass(index), n.sc);
+
+		case TK_STRING_WITH_NUMBERS:
+			return MatchStringWithNumbers(NodeString(n), n.max_len, value);
+	}
+	return false;
+}
+
+// deepest (node, token index) state reached by MatchKidz()
+struct MatchPoint
+{
+	uint32_t node = 0;
+	size_t index = 0;
+};
+
+// Calls f for kidz of parent that match given token until f returns true.
+// Kidz are sorted in a way that in beginning there're string-class matchers
+// followed by exact-string matchers sorted by values, so first check
+// string-class matchers one by one and then lookup exact-string ones.
+template <class F>
+	inline bool ForMatchingKidz(const Node &parent, const TokenizedSample &ts, size_t index,
+		const StringView &head, const F &f) const
+{
+	const Node *kid = _nodes_ptr + parent.kidz_begin;
+	const Node *kidz_strings = kid + parent.kidz_classes;
+	const Node *kidz_end = kid + parent.kidz_count;
+	for (; kid != kidz_strings; ++kid) {
+		if (MatchToken(*kid, ts, index, head) && f(*kid)) {
+			return true;
+		}
+	}
+
+	if (parent.slots_bits) {
+		kid = LookupSlot(parent, head);
+		for (; kid && kid != kidz_end && NodeString(*kid) == head; ++kid) {
+			if (f(*kid)) {
+				return true;
+			}
+		}
+
+	} else if (kidz_end - kidz_strings > BINSEARCH_THRESHOLD) {
+		kid = std::lower_bound(kidz_strings, kidz_end, head,
+			[this](const Node &n, const StringView &v) { return NodeString(n) < v; });
+		for (; kid != kidz_end && NodeString(*kid) == head; ++kid) {
+			if (f(*kid)) {
+				return true;
+			}
+		}
+
+	} else for (; kid != kidz_end; ++kid) {
+		if (kid->str_size == head.size() && NodeString(*kid) == head && f(*kid)) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+template <bool TRACK_DEEPEST>
+	bool MatchKidz(const Node &parent, const TokenizedSample &ts, size_t index, MatchPoint *deepest) const
+{
+	if (TRACK_DEEPEST && index > deepest->index) {
+		deepest->node = uint32_t(&parent - _nodes_ptr);
+		deepest->index = index;
+	}
+	if (index == ts.size()) {
+		return parent.kidz_count == 0;
+	}
+
+	return ForMatchingKidz(parent, ts, index, ts.Token(index),
+		[&](const Node &kid) { return MatchKidz<TRACK_DEEPEST>(kid, ts, index + 1, deepest); });
+}
+
+bool MatchKidzPath(const Node &parent, const TokenizedSample &ts, size_t index, uint32_t *path) const
+{
+	if (index == ts.size()) {
+		return parent.kidz_count == 0;
+	}
+
+	return ForMatchingKidz(parent, ts, index, ts.Token(index), [&](const Node &kid) {
+		path[index] = uint32_t(&kid - _nodes_ptr);
+		return MatchKidzPath(kid, ts, index + 1, path);
+	});
+}
+
+// Matches group of samples having same first index tokens against kidz of parent.
+// Sets results of matched samples, compacts unmatched ones to the beginning
+// of group keeping their order and returns new end of group.
+// Adjacent samples with same next token are matched together, so their
+// common path walked once.
+uint32_t *MatchGroup(const Node &parent, const TokenizedSample *samples,
+	uint32_t *begin, uint32_t *end, size_t index, char *results) const
+{
+	uint32_t *unmatched_end = begin;
+	for (uint32_t *i = begin; i != end;) {
+		const TokenizedSample &ts = samples[*i];
+		if (ts.size() == index) {
+			if (parent.kidz_count == 0) {
+				results[*i] = 1;
+			} else {
+				*(unmatched_end++) = *i;
+			}
+			++i;
+			continue;
+		}
+
+		const StringView &head = ts.Token(index);
+		uint32_t *subgroup_end = i + 1;
+		while (subgroup_end != end && samples[*subgroup_end].size() > index
+		  && samples[*subgroup_end].Token(index) == head) {
+			++subgroup_end;
+		}
+		uint32_t *subgroup_unmatched_end = subgroup_end;
+		if (subgroup_end == i + 1) { // nothing to share with
+			if (MatchKidz<false>(parent, ts, index, nullptr)) {
+				results[*i] = 1;
+			} else {
+				*(unmatched_end++) = *i;
+			}
+			i = subgroup_end;
+			continue;
+		}
+		ForMatchingKidz(parent, ts, index, head, [&](const Node &kid) {
+			subgroup_unmatched_end = MatchGroup(kid, samples, i, subgroup_unmatched_end, index + 1, results);
+			return subgroup_unmatched_end == i;
+		});
+		unmatched_end = std::move(i, subgroup_unmatched_end, unmatched_end);
+		i = subgroup_end;
+	}
+
+	return unmatched_end;
+}
+};
@@ -0,0 +1,215 @@
+#pragma once
+#include <string>
+#include <stdexcept>
+#include <string.h>
+#include <stdio.h>
+#include <errno.h>
+
+#if __cplusplus >= 201703L
+# include <string_view>
+typedef std::string_view InputLineView;
+#else
+typedef std::string InputLineView;
+#endif
+
+#if defined(__unix__) || defined(__APPLE__)
+# define HAVE_MMAP
+# include <sys/mman.h>
+# include <sys/stat.h>
+# include <fcntl.h>
+# include <unistd.h>
+#endif
+
+// Reads text input line by line yielding views of lines without copying them.
+// Regular files are memory-mapped so yielded views stay valid as long as
+// InputLines instance exists. Other inputs (like stdin pipe) are read by
+// chunks into buffer and yielded views valid only until next Next() call,
+// unless 'retain' specified on opening - then whole input is read at once.
+class InputLines
+{
+	enum {
+		READ_CHUNK = 0x10000
+	};
+
+	std::string _buf;
+	const char *_data = nullptr;
+	size_t _size = 0;
+	size_t _pos = 0;
+	bool _persistent = false;
+	bool _eof = false;
+#ifdef HAVE_MMAP
+	int _fd = -1;
+	bool _close_fd = false;
+	void *_map = nullptr;
+	size_t _map_size = 0;
+#else
+	FILE *_f = nullptr;
+	bool _close_f = false;
+#endif
+
+	InputLines(const InputLines &) = delete;
+
+	size_t ReadSome(char *dst, size_t len)
+	{
+#ifdef HAVE_MMAP
+		for (;;) {
+			ssize_t r = read(_fd, dst, len);
+			if (r >= 0) {
+				return (size_t)r;
+			}
+			if (errno != EINTR) {
+				throw std::runtime_error(std::string("read error: ") + strerror(errno));
+			}
+		}
+#else
+		const size_t r = fread(dst, 1, len, _f);
+		if (r == 0 && ferror(_f)) {
+			throw std::runtime_error("read error");
+		}
+		return r;
+#endif
+	}
+
+	// appends next chunk to buffer keeping not yet consumed data, returns false on EOF
+	bool ReadMore()
+	{
+		if (_eof) {
+			return false;
+		}
+		if (!_persistent && _pos != 0) {
+			_buf.erase(0, _pos);
+			_pos = 0;
+		}
+		const size_t prev_size = _buf.size();
+		_buf.resize(prev_size + READ_CHUNK);
+		const size_t r = ReadSome(&_buf[prev_size], READ_CHUNK);
+		_buf.resize(prev_size + r);
+		_data = _buf.data();
+		_size = _buf.size();
+		if (r == 0) {
+			_eof = true;
+			return false;
+		}
+		return true;
+	}
+
+	void Setup(bool retain)
+	{
+#ifdef HAVE_MMAP
+		struct stat st{};
+		if (fstat(_fd, &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0) {
+			void *map = mmap(nullptr, (size_t)st.st_size, PROT_READ, MAP_PRIVATE, _fd, 0);
+			if (map != MAP_FAILED) {
+				madvise(map, (size_t)st.st_size, MADV_SEQUENTIAL);
+				_map = map;
+				_map_size = (size_t)st.st_size;
+				_data = (const char *)map;
+				_size = _map_size;
+				_persistent = true;
+				_eof = true;
+				return;
+			}
+		}
+#endif
+		if (retain) {
+			_persistent = true;
+			while (ReadMore()) {
+				;
+			}
+		}
+	}
+
+public:
+	InputLines() = default;
+
+	~InputLines()
+	{
+#ifdef HAVE_MMAP
+		if (_map) {
+			munmap(_map, _map_size);
+		}
+		if (_close_fd) {
+			close(_fd);
+		}
+#else
+		if (_close_f) {
+			fclose(_f);
+		}
+#endif
+	}
+
+	/// Opens given file, returns false if failed
+	bool Open(const char *path, bool retain = false)
+	{
+#ifdef HAVE_MMAP
+		_fd = open(path, O_RDONLY);
+		if (_fd == -1) {
+			return false;
+		}
+		_close_fd = true;
+#else
+		_f = fopen(path, "rb");
+		if (!_f) {
+			return false;
+		}
+		_close_f = true;
+#endif
+		Setup(retain);
+		return true;
+	}
+
+	/// Reads from standard input
+	void OpenStdin(bool retain = false)
+	{
+#ifdef HAVE_MMAP
+		_fd = STDIN_FILENO;
+#else
+		_f = stdin;
+#endif
+		Setup(retain);
+	}
+
+	/// True if yielded lines stay valid during whole lifetime of this instance
+	bool Persistent() const
+	{
+		return _persistent;
+	}
+
+	/// Whole input content, complete only if Persistent()
+	const char *Data() const
+	{
+		return _data;
+	}
+
+	size_t Size() const
+	{
+		return _size;
+	}
+
+	/// Yields next line without trailing newline, returns false on end of input
+	bool Next(InputLineView &line)
+	{
+		size_t scanned = _pos;
+		for (;;) {
+			const char *eol = (scanned < _size)
+				? (const char *)memchr(_data + scanned, '\n', _size - scanned) : nullptr;
+			if (eol) {
+				line = InputLineView(_data + _pos, eol - (_data + _pos));
+				_pos = (eol - _data) + 1;
+				return true;
+			}
+			scanned = _size - _pos; // ReadMore may move not consumed data to buffer's beginning
+			if (!ReadMore()) {
+				break;
+			}
+			scanned+= _pos;
+		}
+
+		if (_pos == _size) {
+			return false;
+		}
+		line = InputLineView(_data + _pos, _size - _pos);
+		_pos = _size;
+		return true;
+	}
+};
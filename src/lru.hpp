@@ -0,0 +1,142 @@
+#pragma once
+#include <stddef.h>
+#include <stdint.h>
+#include <vector>
+#include <algorithm>
+
+// Bounded cache of values keyed by hashes: lookup of existing key makes
+// it most recently used and insertion over capacity evicts least recently
+// used one. Hashes may collide, so values must keep enough to verify them.
+// Items are kept in single array linked into recency list by indices and
+// indexed by open addressing hash table, so after warming up it doesn't
+// allocate memory and evicted values are reused along with their buffers.
+template <class ValueT>
+	class AutoPatternsLRU
+{
+	static constexpr uint32_t NIL = 0xffffffff;
+
+	struct Item
+	{
+		uint64_t key;
+		uint32_t prev, next; // neighbours in recency list
+		ValueT value;
+	};
+
+	std::vector<Item> _items;
+	std::vector<uint32_t> _table; // indices of items, or NIL for empty slots
+	size_t _capacity;
+	uint32_t _head = NIL, _tail = NIL; // most and least recently used items
+
+	inline size_t Slot(uint64_t key) const
+	{
+		return (size_t)(key ^ (key >> 32)) & (_table.size() - 1);
+	}
+
+	// returns slot of item with given key or empty slot where it should be
+	size_t Find(uint64_t key) const
+	{
+		size_t slot = Slot(key);
+		while (_table[slot] != NIL && _items[_table[slot]].key != key) {
+			slot = (slot + 1) & (_table.size() - 1);
+		}
+		return slot;
+	}
+
+	// backward shift deletion keeps probe sequences of remaining keys unbroken
+	void Erase(size_t slot)
+	{
+		const size_t mask = _table.size() - 1;
+		for (size_t next = (slot + 1) & mask; _table[next] != NIL; next = (next + 1) & mask) {
+			const size_t ideal = Slot(_items[_table[next]].key);
+			if (((next - ideal) & mask) >= ((next - slot) & mask)) {
+				_table[slot] = _table[next];
+				slot = next;
+			}
+		}
+		_table[slot] = NIL;
+	}
+
+	void Unlink(uint32_t index)
+	{
+		Item &item = _items[index];
+		(item.prev != NIL ? _items[item.prev].next : _head) = item.next;
+		(item.next != NIL ? _items[item.next].prev : _tail) = item.prev;
+	}
+
+	void LinkFront(uint32_t index)
+	{
+		Item &item = _items[index];
+		item.prev = NIL;
+		item.next = _head;
+		(_head != NIL ? _items[_head].prev : _tail) = index;
+		_head = index;
+	}
+
+	void Touch(uint32_t index)
+	{
+		if (index != _head) {
+			Unlink(index);
+			LinkFront(index);
+		}
+	}
+
+public:
+	AutoPatternsLRU(size_t capacity) : _capacity(capacity ? capacity : 1)
+	{
+		size_t table_size = 4;
+		while (table_size < _capacity * 2) {
+			table_size*= 2;
+		}
+		_table.resize(table_size, NIL);
+	}
+
+	size_t Capacity() const
+	{
+		return _capacity;
+	}
+
+	void Clear()
+	{
+		_items.clear();
+		std::fill(_table.begin(), _table.end(), NIL);
+		_head = _tail = NIL;
+	}
+
+	// returns nullptr if no value with such key
+	ValueT *Lookup(uint64_t key)
+	{
+		const uint32_t index = _table[Find(key)];
+		if (index == NIL) {
+			return nullptr;
+		}
+		Touch(index);
+		return &_items[index].value;
+	}
+
+	// returns value for given key to be filled, existing or evicted one if need
+	ValueT &Insert(uint64_t key)
+	{
+		size_t slot = Find(key);
+		uint32_t index = _table[slot];
+		if (index != NIL) {
+			Touch(index);
+			return _items[index].value;
+		}
+
+		if (_items.size() < _capacity) {
+			index = (uint32_t)_items.size();
+			_items.emplace_back();
+			_items.back().key = key;
+			LinkFront(index);
+
+		} else {
+			index = _tail;
+			Erase(Find(_items[index].key));
+			slot = Find(key);
+			_items[index].key = key;
+			Touch(index);
+		}
+		_table[slot] = index;
+		return _items[index].value;
+	}
+};
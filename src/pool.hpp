@@ -0,0 +1,235 @@
+#pragma once
+#include <stddef.h>
+#include <new>
+#include <vector>
+#include <algorithm>
+
+// Arena of trie's small objects: nodes, their kidz arrays and tokens' strings.
+// Trie owns arena and makes it current for its thread while modifying itself,
+// objects created meanwhile are carved from arena's slabs and freed ones are
+// kept in arena's free lists, separately for each size class, to be reused.
+// Destroying arena releases all its memory at once, so trie made only of its
+// objects may just forget them instead of destroying one by one.
+// Arena isn't thread-safe: threads without current arena allocate from heap,
+// and arena's objects freed there stay allocated till arena's destruction.
+class AutoPatternsArena
+{
+	enum {
+		GRANULARITY = 16,
+		CLASSES = 16,     // blocks up to GRANULARITY * CLASSES bytes carved from slabs
+		SLAB_SIZE = 0x40000
+	};
+
+	// precedes each object, telling where its memory came from
+	struct Header
+	{
+		AutoPatternsArena *arena; // nullptr if from heap
+	};
+
+	// precedes header of big object, links it into list of arena's big objects
+	struct BigLink
+	{
+		BigLink *prev;
+		BigLink *next;
+	};
+
+	struct FreeItem
+	{
+		FreeItem *next;
+	};
+
+	std::vector<char *> _slabs;
+	char *_slab_pos = nullptr;
+	char *_slab_end = nullptr;
+	FreeItem *_free[CLASSES] {};
+	BigLink _bigs {&_bigs, &_bigs};
+	size_t _used = 0;     // bytes of live objects allocated here
+	size_t _reserved = 0; // bytes of slabs and big objects
+
+	static AutoPatternsArena *&CurrentRef()
+	{
+		static thread_local AutoPatternsArena *s_current = nullptr;
+		return s_current;
+	}
+
+	void *AllocateSmall(size_t cls)
+	{
+		const size_t size = (cls + 1) * GRANULARITY;
+		_used+= size;
+		FreeItem *item = _free[cls];
+		if (item) {
+			_free[cls] = item->next;
+			return item;
+		}
+		if (_slab_pos + size > _slab_end) {
+			_slabs.reserve(_slabs.size() + 1);
+			_slab_pos = (char *)::operator new(SLAB_SIZE);
+			_slab_end = _slab_pos + SLAB_SIZE;
+			_slabs.emplace_back(_slab_pos);
+			_reserved+= SLAB_SIZE;
+		}
+		Header *hdr = (Header *)_slab_pos;
+		hdr->arena = this;
+		_slab_pos+= size;
+		return hdr + 1;
+	}
+
+	void *AllocateBig(size_t size)
+	{
+		BigLink *link = (BigLink *)::operator new(sizeof(BigLink) + sizeof(Header) + size);
+		link->prev = &_bigs;
+		link->next = _bigs.next;
+		_bigs.next->prev = link;
+		_bigs.next = link;
+		Header *hdr = (Header *)(link + 1);
+		hdr->arena = this;
+		_used+= size;
+		_reserved+= size;
+		return hdr + 1;
+	}
+
+	void FreeBig(void *p, size_t size)
+	{
+		BigLink *link = (BigLink *)((Header *)p - 1) - 1;
+		link->prev->next = link->next;
+		link->next->prev = link->prev;
+		::operator delete(link);
+		_used-= size;
+		_reserved-= size;
+	}
+
+public:
+	/// Makes given arena (or none if nullptr) current for calling thread during own lifetime
+	class Scope
+	{
+		AutoPatternsArena *_prev;
+
+	public:
+		Scope(AutoPatternsArena *arena)
+			: _prev(CurrentRef())
+		{
+			CurrentRef() = arena;
+		}
+
+		~Scope()
+		{
+			CurrentRef() = _prev;
+		}
+
+		Scope(const Scope &) = delete;
+		Scope &operator=(const Scope &) = delete;
+	};
+
+	AutoPatternsArena() = default;
+	AutoPatternsArena(const AutoPatternsArena &) = delete;
+	AutoPatternsArena &operator=(const AutoPatternsArena &) = delete;
+
+	~AutoPatternsArena()
+	{
+		for (BigLink *link = _bigs.next; link != &_bigs; ) {
+			BigLink *next = link->next;
+			::operator delete(link);
+			link = next;
+		}
+		for (char *slab : _slabs) {
+			::operator delete(slab);
+		}
+	}
+
+	/// Returns true if most of arena's memory isn't used by live objects anymore
+	bool Sparse() const
+	{
+		const size_t unused = _reserved - _used;
+		return unused > std::max(_used, (size_t)SLAB_SIZE * 4);
+	}
+
+	/// Allocates object from current arena, or from heap if there is no current arena
+	static void *Allocate(size_t size)
+	{
+		AutoPatternsArena *arena = CurrentRef();
+		if (!arena) {
+			Header *hdr = (Header *)::operator new(sizeof(Header) + size);
+			hdr->arena = nullptr;
+			return hdr + 1;
+		}
+		const size_t cls = (size + sizeof(Header) - 1) / GRANULARITY;
+		if (cls >= CLASSES) {
+			return arena->AllocateBig(size);
+		}
+		return arena->AllocateSmall(cls);
+	}
+
+	/// Frees object of given size: its reused only by arena it came from if that arena
+	/// is current, otherwise kept till arena's destruction
+	static void Free(void *p, size_t size)
+	{
+		Header *hdr = (Header *)p - 1;
+		if (!hdr->arena) {
+			::operator delete(hdr);
+			return;
+		}
+		AutoPatternsArena *arena = CurrentRef();
+		if (hdr->arena != arena) {
+			return;
+		}
+		const size_t cls = (size + sizeof(Header) - 1) / GRANULARITY;
+		if (cls >= CLASSES) {
+			arena->FreeBig(p, size);
+			return;
+		}
+		FreeItem *item = (FreeItem *)p;
+		item->next = arena->_free[cls];
+		arena->_free[cls] = item;
+		arena->_used-= (cls + 1) * GRANULARITY;
+	}
+};
+
+// Mix into class to allocate its (and its subclasses') instances by AutoPatternsArena
+struct AutoPatternsArenaAllocated
+{
+	static void *operator new(size_t size)
+	{
+		return AutoPatternsArena::Allocate(size);
+	}
+
+	static void operator delete(void *p, size_t size)
+	{
+		AutoPatternsArena::Free(p, size);
+	}
+};
+
+// Allocator of containers kept by arena's objects
+template <class T>
+	struct AutoPatternsArenaAllocator
+{
+	typedef T value_type;
+
+	AutoPatternsArenaAllocator() = default;
+
+	template <class U>
+		AutoPatternsArenaAllocator(const AutoPatternsArenaAllocator<U> &)
+	{
+	}
+
+	T *allocate(size_t n)
+	{
+		return (T *)AutoPatternsArena::Allocate(n * sizeof(T));
+	}
+
+	void deallocate(T *p, size_t n)
+	{
+		AutoPatternsArena::Free(p, n * sizeof(T));
+	}
+
+	template <class U>
+		bool operator ==(const AutoPatternsArenaAllocator<U> &) const
+	{
+		return true;
+	}
+
+	template <class U>
+		bool operator !=(const AutoPatternsArenaAllocator<U> &) const
+	{
+		return false;
+	}
+};
@@ -0,0 +1,226 @@
+#pragma once
+#if defined(__unix__) || defined(__APPLE__)
+#define HAVE_SERVER
+#include <string>
+#include <functional>
+#include <thread>
+#include <stdexcept>
+#include <string.h>
+#include <errno.h>
+#include <signal.h>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Line-oriented request-reply protocol over Unix domain socket:
+// client sends requests each terminated by newline and for each request
+// server replies with single line, also terminated by newline.
+// Requests of single client are handled in order they're sent, so client
+// may send many requests before reading replies, that then sent together.
+class LineSocket
+{
+	enum {
+		READ_CHUNK = 0x10000,
+		LINE_LIMIT = 0x1000000
+	};
+
+	int _fd = -1;
+	std::string _buf;
+	size_t _pos = 0;
+	std::string _out; // written but not yet sent lines
+
+	LineSocket(const LineSocket &) = delete;
+
+	static sockaddr_un Address(const char *path)
+	{
+		sockaddr_un out{};
+		out.sun_family = AF_UNIX;
+		if (strlen(path) >= sizeof(out.sun_path)) {
+			throw std::runtime_error(std::string("socket path too long: ") + path);
+		}
+		strcpy(out.sun_path, path);
+		return out;
+	}
+
+	static std::runtime_error Error(const char *what)
+	{
+		return std::runtime_error(std::string(what) + ": " + strerror(errno));
+	}
+
+	// Removes socket left by previous server at given path, so it can be bound again.
+	// Throws if path is not a socket or if some server still listens it.
+	static void RemoveStaleSocket(const char *path, const sockaddr_un &addr)
+	{
+		struct stat st;
+		if (lstat(path, &st) == -1) {
+			if (errno == ENOENT) {
+				return;
+			}
+			throw Error("lstat");
+		}
+		if (!S_ISSOCK(st.st_mode)) {
+			throw std::runtime_error(std::string("not a socket: ") + path);
+		}
+		LineSocket probe(socket(AF_UNIX, SOCK_STREAM, 0));
+		if (probe._fd == -1) {
+			throw Error("socket");
+		}
+		if (connect(probe._fd, (const sockaddr *)&addr, sizeof(addr)) == 0) {
+			throw std::runtime_error(std::string("already served: ") + path);
+		}
+		if (unlink(path) == -1 && errno != ENOENT) {
+			throw Error("unlink");
+		}
+	}
+
+public:
+	typedef std::function<bool(const std::string &request, std::string &reply)> Handler;
+
+	LineSocket(int fd = -1) : _fd(fd)
+	{
+	}
+
+	~LineSocket()
+	{
+		if (_fd != -1) {
+			close(_fd);
+		}
+	}
+
+	/// Connects to server listening given path, throws on failure
+	void Connect(const char *path)
+	{
+		const sockaddr_un addr = Address(path);
+		_fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (_fd == -1) {
+			throw Error("socket");
+		}
+		if (connect(_fd, (const sockaddr *)&addr, sizeof(addr)) == -1) {
+			throw Error("connect");
+		}
+	}
+
+	/// Shuts down sending side, so peer reads end of input
+	void ShutdownSend()
+	{
+		shutdown(_fd, SHUT_WR);
+	}
+
+	/// Reads next line without trailing newline, returns false on end of input
+	bool ReadLine(std::string &line)
+	{
+		for (size_t scanned = _pos;;) {
+			const size_t eol = _buf.find('\n', scanned);
+			if (eol != std::string::npos) {
+				line.assign(_buf, _pos, eol - _pos);
+				_pos = eol + 1;
+				return true;
+			}
+			if (_buf.size() - _pos > LINE_LIMIT) {
+				throw std::runtime_error("too long line");
+			}
+			_buf.erase(0, _pos);
+			_pos = 0;
+			scanned = _buf.size();
+			_buf.resize(scanned + READ_CHUNK);
+			ssize_t r;
+			do {
+				r = read(_fd, &_buf[scanned], READ_CHUNK);
+			} while (r < 0 && errno == EINTR);
+			_buf.resize(scanned + (r > 0 ? r : 0));
+			if (r <= 0) {
+				if (_buf.empty()) {
+					return false;
+				}
+				line.swap(_buf);
+				_buf.clear();
+				return true;
+			}
+		}
+	}
+
+	/// True if there's complete line that can be read without waiting
+	bool Buffered() const
+	{
+		return _buf.find('\n', _pos) != std::string::npos;
+	}
+
+	/// Queues given line to be sent with newline appended by next Flush()
+	void WriteLine(const std::string &line)
+	{
+		_out+= line;
+		_out+= '\n';
+	}
+
+	/// Sends queued lines, returns false on failure
+	bool Flush()
+	{
+		size_t written = 0;
+		while (written < _out.size()) {
+			const ssize_t r = write(_fd, _out.data() + written, _out.size() - written);
+			if (r < 0 && errno != EINTR) {
+				break;
+			}
+			written+= (r > 0) ? r : 0;
+		}
+		const bool out = (written == _out.size());
+		_out.clear();
+		return out;
+	}
+
+	/// Listens given path and serves connecting clients forever, each client by own thread.
+	/// Handler called for each request, it may return false to close connection after reply.
+	/// Throws if failed to listen.
+	static void Serve(const char *path, const Handler &handler)
+	{
+		signal(SIGPIPE, SIG_IGN); // disconnected clients must not kill server
+		const sockaddr_un addr = Address(path);
+		LineSocket listener(socket(AF_UNIX, SOCK_STREAM, 0));
+		if (listener._fd == -1) {
+			throw Error("socket");
+		}
+		RemoveStaleSocket(path, addr);
+		if (bind(listener._fd, (const sockaddr *)&addr, sizeof(addr)) == -1) {
+			throw Error("bind");
+		}
+		if (listen(listener._fd, SOMAXCONN) == -1) {
+			throw Error("listen");
+		}
+		for (;;) {
+			const int fd = accept(listener._fd, nullptr, nullptr);
+			if (fd == -1) {
+				if (errno == EINTR || errno == ECONNABORTED) {
+					continue;
+				}
+				if (errno == EMFILE || errno == ENFILE) { // wait for some clients to disconnect
+					usleep(100000);
+					continue;
+				}
+				throw Error("accept");
+			}
+			std::thread([fd, handler] {
+				LineSocket client(fd);
+				std::string request, reply;
+				try {
+					while (client.ReadLine(request)) {
+						reply.clear();
+						const bool keep = handler(request, reply);
+						client.WriteLine(reply);
+						// replies to pipelined requests are sent together
+						if ((!client.Buffered() || !keep) && !client.Flush()) {
+							break;
+						}
+						if (!keep) {
+							break;
+						}
+					}
+				} catch (std::exception &e) {
+					client.WriteLine(std::string("error ") + e.what());
+					client.Flush();
+				}
+			}).detach();
+		}
+	}
+};
+#endif
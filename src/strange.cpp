@@ -1,10 +1,20 @@
 #include <fstream>
 #include <vector>
+#include <list>
 #include <string>
 #include <string.h>
 #include <iostream>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <deque>
+#include <map>
+#include <sstream>
 
 #include "autopatterns.hpp"
+#include "input.hpp"
+#include "follow.hpp"
+#include "server.hpp"
 
 #ifndef VERINFO
 # define VERINFO "???"
@@ -20,39 +30,79 @@
 
 typedef AutoPatterns<char> AutoPatternsC;
 
-static bool TrimLine(std::string &line)
+template <class StringT>
+	static bool TrimLine(StringT &line)
 {
-	while (!line.empty() && (line.back() == '\r' || line.back() == '\n'
-			|| line.back() == ' ' || line.back() == '\t')) {
-		line.pop_back();
+	size_t begin = 0, end = line.size();
+	while (end > begin && (line[end - 1] == '\r' || line[end - 1] == '\n'
+			|| line[end - 1] == ' ' || line[end - 1] == '\t')) {
+		--end;
 	}
-	while (!line.empty() && (line.front() == ' ' || line.front() == '\t' || line.front() == '\r')) {
-		line.erase(line.begin());
+	while (begin < end && (line[begin] == ' ' || line[begin] == '\t' || line[begin] == '\r')) {
+		++begin;
+	}
+	if (begin != 0 || end != line.size()) {
+		line = line.substr(begin, end - begin);
 	}
 	return !line.empty();
 }
 
 
-struct LoadLines : std::vector<std::string>
+// Keeps inputs opened, so loaded lines refer directly to their content
+struct LoadLines : std::vector<InputLineView>
 {
-	template <class IStream>
-		bool Load(IStream &is)
+	bool Load(const char *path)
 	{
-		std::string line;
-		while (std::getline(is, line)) if (TrimLine(line)) {
-			emplace_back(line);
+		_inputs.emplace_back();
+		if (!_inputs.back().Open(path, true)) {
+			_inputs.pop_back();
+			return false;
 		}
+		Collect(_inputs.back());
 		return true;
 	}
+
+	void LoadStdin()
+	{
+		_inputs.emplace_back();
+		_inputs.back().OpenStdin(true);
+		Collect(_inputs.back());
+	}
+
+private:
+	std::list<InputLines> _inputs;
+
+	void Collect(InputLines &in)
+	{
+		InputLineView line;
+		while (in.Next(line)) if (TrimLine(line)) {
+			emplace_back(line);
+		}
+	}
 };
 
 class Commander
 {
+	enum {
+		EVAL_BATCH_SIZE = 256,
+		EVAL_BATCHES_PER_THREAD = 4
+	};
+
+	std::unique_ptr<InputLines> _t_input; // binary trie file that _t may refer to, so keep it declared before _t
 	AutoPatternsC::TriePtr _t;
+	size_t _threads = 1;
+	size_t _learn_limit = 0; // if nonzero then -learn reads input by batches of that much bytes
 	size_t _context = 0;
+	size_t _descript_budget = AutoPatternsC::DESCRIPT_BUDGET_DEFAULT;
+	size_t _descript_exhausted = 0; // lines described with exhausted budget since last report
+	size_t _cache_capacity = 0; // if nonzero then -eval uses MatchCache of that capacity per thread
+	std::vector<AutoPatternsC::MatchCache> _caches;
 	int _exit_code = 0;
 	bool _descript = false;
 	bool _color = false;
+	bool _cache_stats = false;
+	bool _dag = false;
+	std::string _header; // if not empty then printed before next printed line
 
 	enum ExitCodeBit
 	{
@@ -81,8 +131,17 @@ class Commander
 
 	////////
 
-	void PrintMatchingLine(const std::string &line)
+	void PrintHeader()
+	{
+		if (!_header.empty()) {
+			std::cout << _header << std::endl;
+			_header.clear();
+		}
+	}
+
+	void PrintMatchingLine(const InputLineView &line)
 	{
+		PrintHeader();
 		if (_color) {
 			std::cout << ANSI_GREEN << line << ANSI_DEFAULT << std::endl;
 		} else {
@@ -90,71 +149,84 @@ class Commander
 		}
 	}
 
-	void PrintMismatchingLine(const std::string &line)
+	void PrintDescription(std::ostream &os, const AutoPatternsC::SampleDescription &sd, bool color)
 	{
+		char status_fin_char = -1;
+		for (const auto &td : sd) {
+			switch (td.status) {
+				case AutoPatternsC::TS_MATCH:
+					if (color && status_fin_char) {
+						os << ANSI_GREEN_HI;
+					} else if (status_fin_char > 0) {
+						os << status_fin_char;
+					}
+					status_fin_char = 0;
+					break;
+				case AutoPatternsC::TS_MISMATCH:
+					if (color && status_fin_char != ']') {
+						os << ANSI_YELLOW_HI;
+					} else if (status_fin_char != ']') {
+						if (status_fin_char > 0) {
+							os << status_fin_char;
+						}
+						os << '[';
+					}
+					status_fin_char = ']';
+					break;
+				case AutoPatternsC::TS_REDUNDANT:
+					if (color && status_fin_char != '>') {
+						os << ANSI_RED_HI;
+					} else if (status_fin_char != '>') {
+						if (status_fin_char > 0) {
+							os << status_fin_char;
+						}
+						os << '<';
+					}
+					status_fin_char = '>';
+					break;
+				case AutoPatternsC::TS_MISSING:
+					if (color && status_fin_char != ')') {
+						os << ANSI_RED_HI;
+					} else if (status_fin_char != ')') {
+						if (status_fin_char > 0) {
+							os << status_fin_char;
+						}
+						os << '(';
+					}
+					status_fin_char = ')';
+					break;
+			}
+			if (td.status != AutoPatternsC::TS_MISSING) {
+				os << td.token;
+			} else {
+				os << "\xE2\x80\xA2"; // '?';//
+			}
+		}
+		if (color) {
+			os << ANSI_DEFAULT;
+		} else if (status_fin_char > 0) {
+			os << status_fin_char;
+		}
+	}
+
+	void PrintMismatchingLine(const InputLineView &line, const AutoPatternsC::SampleDescription *sd)
+	{
+		PrintHeader();
 		if (!_color) {
 			std::cout << '!';
 		}
 
 		if (_descript) {
-			const auto &sd = _t->Descript(line);
-			char status_fin_char = -1;
-			for (const auto &td : sd) {
-				switch (td.status) {
-					case AutoPatternsC::TS_MATCH:
-						if (_color && status_fin_char) {
-							std::cout << ANSI_GREEN_HI;
-						} else if (status_fin_char > 0) {
-							std::cout << status_fin_char;
-						}
-						status_fin_char = 0;
-						break;
-					case AutoPatternsC::TS_MISMATCH:
-						if (_color && status_fin_char != ']') {
-							std::cout << ANSI_YELLOW_HI;
-						} else if (status_fin_char != ']') {
-							if (status_fin_char > 0) {
-								std::cout << status_fin_char;
-							}
-							std::cout << '[';
-						}
-						status_fin_char = ']';
-						break;
-					case AutoPatternsC::TS_REDUNDANT:
-						if (_color && status_fin_char != '>') {
-							std::cout << ANSI_RED_HI;
-						} else if (status_fin_char != '>') {
-							if (status_fin_char > 0) {
-								std::cout << status_fin_char;
-							}
-							std::cout << '<';
-						}
-						status_fin_char = '>';
-						break;
-					case AutoPatternsC::TS_MISSING:
-						if (_color && status_fin_char != ')') {
-							std::cout << ANSI_RED_HI;
-						} else if (status_fin_char != ')') {
-							if (status_fin_char > 0) {
-								std::cout << status_fin_char;
-							}
-							std::cout << '(';
-						}
-						status_fin_char = ')';
-						break;
-				}
-				if (td.status != AutoPatternsC::TS_MISSING) {
-					std::cout << td.token;
-				} else {
-					std::cout << "\xE2\x80\xA2"; // '?';//
+			AutoPatternsC::SampleDescription own_sd;
+			if (!sd) {
+				bool exhausted = false;
+				own_sd = _t->Descript(line, _descript_budget, &exhausted);
+				if (exhausted) {
+					++_descript_exhausted;
 				}
+				sd = &own_sd;
 			}
-			if (_color) {
-				std::cout << ANSI_DEFAULT;
-			} else if (status_fin_char > 0) {
-				std::cout << status_fin_char;
-			}
-
+			PrintDescription(std::cout, *sd, _color);
 
 		} else if (_color) {
 			std::cout << ANSI_YELLOW_HI << line << ANSI_DEFAULT;
@@ -166,69 +238,530 @@ class Commander
 		std::cout << std::endl;
 	}
 
-	template <class IStream>
-		void EvalStream(IStream &is, bool dialog)
+	struct EvalState
 	{
-		std::string line;
 		std::list<std::string> context_matching_backlog;
 		std::vector<std::string> learn_lines;
 		size_t context_matching_countdown = 0;
-		for (size_t index = 0; std::getline(is, line); ++index) if (TrimLine(line)) {
-			bool matched = _t->Match(line);
-			if (matched && dialog) {
-				learn_lines.emplace_back(line);
+	};
+
+	void EvalResult(EvalState &es, const InputLineView &line, bool matched,
+		const AutoPatternsC::SampleDescription *sd, bool dialog)
+	{
+		if (matched && dialog) {
+			es.learn_lines.emplace_back(line);
+		}
+		if (!matched) {
+			ToggleExitCode(ECB_ANOMALY);
+			if (_context != 0 && _context != std::string::npos) {
+				es.context_matching_countdown = _context;
+				if (!es.context_matching_backlog.empty()) {
+					for (const auto &matching_line : es.context_matching_backlog) {
+						PrintMatchingLine(matching_line);
+					}
+				}
 			}
-			if (!matched) {
-				ToggleExitCode(ECB_ANOMALY);
-				if (_context != 0 && _context != std::string::npos) {
-					context_matching_countdown = _context;
-					if (!context_matching_backlog.empty()) {
-						for (const auto &matching_line : context_matching_backlog) {
-							PrintMatchingLine(matching_line);
-						}
+			PrintMismatchingLine(line, sd);
+			es.context_matching_backlog.clear();
+			if (dialog) for (;;) {
+				std::cout << "Learn this sample? y/N" << std::endl;
+				char c;
+				std::cin >> c;
+				if (c == 'y' || c == 'Y') {
+					es.learn_lines.emplace_back(line);
+					break;
+				}
+				if (c == 'n' || c == 'N' || c == '\r' || c == '\n') {
+					break;
+				}
+			}
+
+		} else if (_context == 0) {
+			;
+
+		} else if (_context == std::string::npos) {
+			PrintMatchingLine(line);
+
+		} else if (es.context_matching_countdown) {
+			PrintMatchingLine(line);
+			--es.context_matching_countdown;
+			if (es.context_matching_countdown == 0) {
+				std::cout << std::endl;
+			}
+
+		} else {
+			es.context_matching_backlog.emplace_back(line);
+			if (es.context_matching_backlog.size() > _context) {
+				es.context_matching_backlog.pop_front();
+			}
+		}
+	}
+
+	// returns nullptr if caching disabled
+	AutoPatternsC::MatchCache *Cache(size_t thread)
+	{
+		if (_cache_capacity == 0) {
+			return nullptr;
+		}
+		while (_caches.size() <= thread) {
+			_caches.emplace_back(_cache_capacity);
+		}
+		return &_caches[thread];
+	}
+
+	void PrintCacheStats()
+	{
+		size_t lookups = 0, hits = 0;
+		for (auto &cache : _caches) {
+			lookups+= cache.lookups;
+			hits+= cache.hits;
+			cache.lookups = cache.hits = 0;
+		}
+		std::cerr << "Cache: " << std::dec << lookups << " lookup(s), " << hits << " hit(s), hit rate "
+			<< (lookups ? hits * 100 / lookups : 0) << "%" << std::endl;
+	}
+
+	void EvalStream(InputLines &in, bool dialog)
+	{
+		if (_threads > 1 && !dialog) {
+			EvalStreamThreaded(in);
+			return;
+		}
+
+		EvalState es;
+		InputLineView line;
+		AutoPatternsC::MatchCache *cache = Cache(0);
+		while (in.Next(line)) if (TrimLine(line)) {
+			EvalResult(es, line, cache ? _t->Match(line, *cache) : _t->Match(line), nullptr, dialog);
+		}
+
+		if (!es.learn_lines.empty()) {
+			_t->Learn(es.learn_lines, _threads);
+		}
+	}
+
+#ifdef HAVE_FOLLOW
+	// Evaluates lines appended to followed files, each file keeps own context.
+	// If there're multiple files then lines are headed by name of their file
+	// like 'tail' does. Returns only if there're no files to follow.
+	void FollowStream(FollowLines &in)
+	{
+		std::vector<EvalState> states(in.Count());
+		AutoPatternsC::MatchCache *cache = Cache(0);
+		size_t prev_index = (size_t)-1;
+		InputLineView line;
+		while (in.Next(line)) if (TrimLine(line)) {
+			const size_t index = in.Index();
+			if (in.Count() > 1 && index != prev_index) {
+				_header = "==> " + in.Path(index) + " <==";
+				prev_index = index;
+			}
+			EvalResult(states[index], line, cache ? _t->Match(line, *cache) : _t->Match(line), nullptr, false);
+		}
+	}
+#endif
+
+	struct LearnBatch
+	{
+		std::vector<std::string> lines;
+		size_t size = 0;
+	};
+
+	void LearnBatchFlush(LearnBatch &lb)
+	{
+		if (!lb.lines.empty()) {
+			_t->Learn(lb.lines, _threads);
+			lb.lines.clear();
+			lb.size = 0;
+		}
+	}
+
+	// Learns input by batches limited by _learn_limit, so memory usage
+	// depends on patterns amount rather than on input size
+	void LearnStream(LearnBatch &lb, InputLines &in)
+	{
+		InputLineView line;
+		while (in.Next(line)) if (TrimLine(line)) {
+			lb.lines.emplace_back(line);
+			lb.size+= line.size() + sizeof(std::string) + sizeof(InputLineView);
+			if (lb.size >= _learn_limit) {
+				LearnBatchFlush(lb);
+			}
+		}
+	}
+
+	static size_t ParseSize(const char *s)
+	{
+		char *end = nullptr;
+		size_t out = strtoull(s, &end, 10);
+		switch (end ? *end : 0) {
+			case 'g': case 'G': out<<= 10; // fallthrough
+			case 'm': case 'M': out<<= 10; // fallthrough
+			case 'k': case 'K': out<<= 10;
+		}
+		return out;
+	}
+
+	struct EvalBatch
+	{
+		std::string storage; // keeps lines content if input doesn't
+		std::vector<InputLineView> lines;
+		std::vector<char> matched;
+		std::vector<AutoPatternsC::SampleDescription> descriptions;
+		size_t descript_exhausted = 0;
+		bool done = false;
+	};
+
+	typedef std::shared_ptr<EvalBatch> EvalBatchPtr;
+
+	// Reader thread splits input into batches, worker threads match (and descript)
+	// them against trie and this thread outputs batches results in input order,
+	// so output and exit code are the same as of non-threaded EvalStream
+	void EvalStreamThreaded(InputLines &in)
+	{
+		std::mutex mtx;
+		std::condition_variable cond;
+		std::deque<EvalBatchPtr> pending, unprocessed;
+		bool eof = false;
+
+		_t->Freeze();
+		std::vector<AutoPatternsC::MatchCache *> caches(_threads);
+		Cache(_threads - 1); // creates all caches at once, so pointers to them stay valid
+		for (size_t i = 0; i != _threads; ++i) {
+			caches[i] = Cache(i);
+		}
+
+		std::thread reader([&] {
+			InputLineView line;
+			std::vector<size_t> ends;
+			while (!eof) {
+				EvalBatchPtr batch = std::make_shared<EvalBatch>();
+				ends.clear();
+				while (batch->lines.size() < EVAL_BATCH_SIZE && in.Next(line)) if (TrimLine(line)) {
+					if (in.Persistent()) {
+						batch->lines.emplace_back(line);
+					} else {
+						batch->storage.append(line.data(), line.size());
+						batch->lines.emplace_back();
+						ends.emplace_back(batch->storage.size());
 					}
 				}
-				PrintMismatchingLine(line);
-				context_matching_backlog.clear();
-				if (dialog) for (;;) {
-					std::cout << "Learn this sample? y/N" << std::endl;
-					char c;
-					std::cin >> c;
-					if (c == 'y' || c == 'Y') {
-						learn_lines.emplace_back(line);
+				for (size_t i = 0, begin = 0; i != ends.size(); begin = ends[i], ++i) {
+					batch->lines[i] = InputLineView(batch->storage.data() + begin, ends[i] - begin);
+				}
+				std::unique_lock<std::mutex> lock(mtx);
+				cond.wait(lock, [&] { return pending.size() < _threads * EVAL_BATCHES_PER_THREAD; });
+				eof = (batch->lines.size() < EVAL_BATCH_SIZE);
+				pending.emplace_back(batch);
+				unprocessed.emplace_back(batch);
+				cond.notify_all();
+			}
+		});
+
+		std::vector<std::thread> workers;
+		for (size_t i = 0; i != _threads; ++i) {
+			workers.emplace_back([&, i] {
+				std::unique_lock<std::mutex> lock(mtx);
+				for (;;) {
+					cond.wait(lock, [&] { return !unprocessed.empty() || eof; });
+					if (unprocessed.empty()) {
 						break;
 					}
-					if (c == 'n' || c == 'N' || c == '\r' || c == '\n') {
+					EvalBatchPtr batch = unprocessed.front();
+					unprocessed.pop_front();
+					lock.unlock();
+					if (caches[i]) {
+						batch->matched.resize(batch->lines.size());
+						for (size_t j = 0; j != batch->lines.size(); ++j) {
+							batch->matched[j] = _t->Match(batch->lines[j], *caches[i]);
+						}
+					} else {
+						_t->Match(batch->lines, batch->matched);
+					}
+					batch->descriptions.resize(batch->lines.size());
+					for (size_t j = 0; j != batch->lines.size(); ++j) {
+						if (!batch->matched[j] && _descript) {
+							bool exhausted = false;
+							batch->descriptions[j] = _t->Descript(batch->lines[j], _descript_budget, &exhausted);
+							if (exhausted) {
+								++batch->descript_exhausted;
+							}
+						}
+					}
+					lock.lock();
+					batch->done = true;
+					cond.notify_all();
+				}
+			});
+		}
+
+		EvalState es;
+		for (;;) {
+			EvalBatchPtr batch;
+			{
+				std::unique_lock<std::mutex> lock(mtx);
+				cond.wait(lock, [&] { return (!pending.empty() && pending.front()->done) || (eof && pending.empty()); });
+				if (pending.empty()) {
+					break;
+				}
+				batch = pending.front();
+				pending.pop_front();
+				cond.notify_all();
+			}
+			for (size_t j = 0; j != batch->lines.size(); ++j) {
+				EvalResult(es, batch->lines[j], batch->matched[j] != 0, &batch->descriptions[j], false);
+			}
+			_descript_exhausted+= batch->descript_exhausted;
+		}
+
+		reader.join();
+		for (auto &worker : workers) {
+			worker.join();
+		}
+	}
+
+	// Loads text or binary trie from given file, returns false if cant open it
+	static bool LoadTrie(const char *path, AutoPatternsC::TriePtr &t, std::unique_ptr<InputLines> &t_input)
+	{
+		std::unique_ptr<InputLines> in(new InputLines);
+		if (!in->Open(path, true)) {
+			return false;
+		}
+		if (AutoPatternsC::Trie::IsBinary(in->Data(), in->Size())) {
+			// binary trie used directly from mapped file
+			t.reset();
+			t_input = std::move(in);
+			t.reset(new AutoPatternsC::Trie(t_input->Data(), t_input->Size()));
+			return true;
+		}
+		// text trie parsed directly from mapped file
+		t.reset(new AutoPatternsC::Trie(InputLineView(in->Data(), in->Size())));
+		return true;
+	}
+
+	// Makes _t to not use file its mapped from anymore, so that file may be overwritten
+	void DetachTrieInput()
+	{
+		if (_t_input) {
+			_t->Detach();
+			_t_input.reset();
+		}
+	}
+
+#ifdef HAVE_SERVER
+	// Trie kept by -serve. Its evaluated without locking, using frozen snapshot
+	// of trie that is replaced when background learning completes.
+	struct ServedTrie
+	{
+		std::unique_ptr<InputLines> input; // binary trie file that trie may refer to, so keep it declared before trie
+		AutoPatternsC::TriePtr trie;
+		std::string path; // file trie loaded from, saved to it by default
+		std::mutex mtx; // serializes learning and saving
+		std::mutex learn_mtx;
+		std::vector<std::string> learn_lines; // guarded by learn_mtx
+		bool learning = false; // guarded by learn_mtx, true while background thread learns learn_lines
+	};
+
+	typedef std::shared_ptr<ServedTrie> ServedTriePtr;
+
+	std::mutex _served_mtx;
+	std::map<std::string, ServedTriePtr> _served;
+
+	// returns nullptr if no such trie and not asked to create it
+	ServedTriePtr Served(const std::string &name, bool create)
+	{
+		std::lock_guard<std::mutex> lock(_served_mtx);
+		auto &out = _served[name];
+		if (!out && create) {
+			out = std::make_shared<ServedTrie>();
+			out->trie.reset(new AutoPatternsC::Trie);
+			out->trie->Freeze(); // so its learning wont disturb evaluations
+		}
+		if (!out) {
+			_served.erase(name);
+		}
+		return out;
+	}
+
+	// learns queued samples, caller must hold st.mtx
+	void ServedLearn(ServedTrie &st, std::vector<std::string> &lines)
+	{
+		{
+			std::lock_guard<std::mutex> lock(st.learn_mtx);
+			lines.swap(st.learn_lines);
+		}
+		if (!lines.empty()) {
+			st.trie->Learn(lines, _threads);
+			lines.clear();
+		}
+	}
+
+	// Learning takes long, so samples are queued and learned by batches in background
+	// while evaluations still use previous version of trie. Thread that learns keeps
+	// learning while there're queued samples.
+	void ServedLearnQueue(const ServedTriePtr &st, const InputLineView &line)
+	{
+		std::lock_guard<std::mutex> lock(st->learn_mtx);
+		st->learn_lines.emplace_back(line);
+		if (!st->learning) {
+			st->learning = true;
+			std::thread([this, st] {
+				std::vector<std::string> lines;
+				for (;;) {
+					std::lock_guard<std::mutex> lock(st->mtx);
+					ServedLearn(*st, lines);
+					std::lock_guard<std::mutex> learn_lock(st->learn_mtx);
+					if (st->learn_lines.empty()) {
+						st->learning = false;
 						break;
 					}
 				}
+			}).detach();
+		}
+	}
 
-			} else if (_context == 0) {
-				;
+	// handles request of -serve, see PrintUsage for protocol description
+	bool ServeRequest(const std::string &request, std::string &reply)
+	{
+		const size_t op_end = std::min(request.find(' '), request.size());
+		const size_t name_end = std::min(request.find(' ', op_end + 1), request.size());
+		const std::string op = request.substr(0, op_end);
+		const std::string name = request.substr(std::min(op_end + 1, request.size()), name_end - std::min(op_end + 1, request.size()));
+		InputLineView arg(request.data() + std::min(name_end + 1, request.size()), request.size() - std::min(name_end + 1, request.size()));
 
-			} else if (_context == std::string::npos) {
-				PrintMatchingLine(line);
+		if (op == "quit") {
+			reply = "ok";
+			return false;
+		}
+		if (name.empty()) {
+			reply = "error bad request";
+			return true;
+		}
 
-			} else if (context_matching_countdown) {
-				PrintMatchingLine(line);
-				--context_matching_countdown;
-				if (context_matching_countdown == 0) {
-					std::cout << std::endl;
+		if (op == "load") {
+			auto st = std::make_shared<ServedTrie>();
+			st->path.assign(arg.data(), arg.size());
+			try {
+				if (!LoadTrie(st->path.c_str(), st->trie, st->input)) {
+					reply = "error can't open: " + st->path;
+					return true;
 				}
+			} catch (std::exception &e) { // malformed trie must not close connection
+				reply = std::string("error ") + e.what();
+				return true;
+			}
+			st->trie->Freeze();
+			std::lock_guard<std::mutex> lock(_served_mtx);
+			_served[name] = st;
+			reply = "ok";
+
+		} else if (op == "unload") {
+			std::lock_guard<std::mutex> lock(_served_mtx);
+			reply = _served.erase(name) ? "ok" : "error no such trie";
+
+		} else if (op == "learn") {
+			if (!TrimLine(arg)) {
+				reply = "error empty line";
+				return true;
+			}
+			ServedLearnQueue(Served(name, true), arg);
+			reply = "ok";
+
+		} else if (op == "eval" || op == "descript") {
+			auto st = Served(name, false);
+			if (!st) {
+				reply = "error no such trie";
+				return true;
+			}
+			if (!TrimLine(arg)) {
+				reply = "error empty line";
+				return true;
+			}
+			if (st->trie->Match(arg)) {
+				reply = "match";
+
+			} else if (op == "descript") {
+				std::ostringstream os;
+				os << "mismatch ";
+				PrintDescription(os, st->trie->Descript(arg, _descript_budget), false);
+				reply = os.str();
 
 			} else {
-				context_matching_backlog.emplace_back(line);
-				if (context_matching_backlog.size() > _context) {
-					context_matching_backlog.pop_front();
-				}
+				reply = "mismatch";
 			}
-		}
 
-		if (!learn_lines.empty()) {
-			_t->Learn(learn_lines);
+		} else if (op == "save") {
+			auto st = Served(name, false);
+			if (!st) {
+				reply = "error no such trie";
+				return true;
+			}
+			// saved trie includes everything queued to learn before
+			std::lock_guard<std::mutex> lock(st->mtx);
+			std::vector<std::string> lines;
+			ServedLearn(*st, lines);
+			std::string path(arg.data(), arg.size());
+			if (path.empty()) {
+				path = st->path;
+			}
+			if (path.empty()) { // trie made by learning wasn't loaded from anywhere
+				reply = "error no path";
+				return true;
+			}
+			// written to temporary file that then replaces target, so readers of it never see incomplete trie
+			const std::string tmp_path = path + ".tmp";
+			std::ofstream os(tmp_path);
+			if (!os.is_open()) {
+				reply = "error can't create: " + tmp_path;
+				return true;
+			}
+			st->trie->Save(os, true);
+			os.close();
+			if (!os || rename(tmp_path.c_str(), path.c_str()) != 0) {
+				unlink(tmp_path.c_str());
+				reply = "error can't write: " + path;
+				return true;
+			}
+			reply = "ok";
+
+		} else {
+			reply = "error bad request";
 		}
+		return true;
 	}
 
+	// Sends requests from input to -serve'ing strange and prints its replies
+	void Request(const char *path, InputLines &in)
+	{
+		LineSocket sock;
+		sock.Connect(path);
+		std::thread sender([&] {
+			InputLineView line;
+			size_t queued = 0;
+			while (in.Next(line)) {
+				sock.WriteLine(std::string(line.data(), line.size()));
+				queued+= line.size();
+				if (queued >= 0x10000) {
+					sock.Flush();
+					queued = 0;
+				}
+			}
+			sock.Flush();
+			sock.ShutdownSend();
+		});
+		std::string reply;
+		while (sock.ReadLine(reply)) {
+			if (reply.compare(0, 8, "mismatch") == 0) {
+				ToggleExitCode(ECB_ANOMALY);
+			} else if (reply.compare(0, 5, "error") == 0) {
+				ToggleExitCode(ECB_UNSPECIFIED_ERROR);
+			}
+			std::cout << reply << '\n';
+		}
+		std::cout << std::flush;
+		sender.join();
+	}
+#endif
 
 	void ExecuteInner(const std::string &cmd, char **operands, int operands_count)
 	{
@@ -236,10 +769,54 @@ class Commander
 			_descript = true;
 			CheckOperandsCount(cmd, 0, operands_count);
 
+		} else if (cmd == "descript-budget") {
+			if (CheckOperandsCount(cmd, 1, operands_count)) {
+				_descript_budget = ParseSize(*operands);
+				if (_descript_budget == 0) {
+					_descript_budget = (size_t)-1;
+				}
+			}
+
+		} else if (cmd == "cache") {
+			if (operands_count == 0) {
+				_cache_capacity = 0x10000;
+
+			} else if (CheckOperandsCount(cmd, 1, operands_count)) {
+				_cache_capacity = ParseSize(*operands);
+			}
+			_caches.clear();
+
+		} else if (cmd == "cache-stats") {
+			_cache_stats = true;
+			CheckOperandsCount(cmd, 0, operands_count);
+
+		} else if (cmd == "dag") {
+			_dag = true;
+			if (_t) {
+				_t->ShareSubtrees();
+			}
+			CheckOperandsCount(cmd, 0, operands_count);
+
 		} else if (cmd == "color") {
 			_color = true;
 			CheckOperandsCount(cmd, 0, operands_count);
 
+		} else if (cmd == "threads") {
+			if (operands_count == 0) {
+				_threads = std::max(std::thread::hardware_concurrency(), 1u);
+
+			} else if (CheckOperandsCount(cmd, 1, operands_count)) {
+				_threads = std::max(atoi(*operands), 1);
+			}
+
+		} else if (cmd == "learn-limit") {
+			if (operands_count == 0) {
+				_learn_limit = 0x4000000;
+
+			} else if (CheckOperandsCount(cmd, 1, operands_count)) {
+				_learn_limit = ParseSize(*operands);
+			}
+
 		} else if (cmd == "context") {
 			if (operands_count == 0) {
 				_context = 3;
@@ -258,37 +835,127 @@ class Commander
 					ToggleExitCode(ECB_CMDLINE_ERROR);
 					std::cerr << "-dialog can be used only with input from file(s)" << std::endl;
 				} else {
-					EvalStream(std::cin, false);
+					InputLines in;
+					in.OpenStdin();
+					EvalStream(in, false);
 				}
 
 			} else for (int i = 0; i < operands_count; ++i) {
-				std::ifstream is(operands[i]);
-				if (!is.is_open()) {
+				InputLines in;
+				if (!in.Open(operands[i])) {
 					ToggleExitCode(ECB_READ_ERROR);
 					std::cerr << "Can't open: " << operands[i] << std::endl;
 				} else {
-					EvalStream(is, cmd == "dialog");
+					EvalStream(in, cmd == "dialog");
 				}
 			}
+			if (_descript_exhausted != 0) {
+				std::cerr << "Descript budget exhausted for " << std::dec << _descript_exhausted
+					<< " line(s), their descriptions may be inexact" << std::endl;
+				_descript_exhausted = 0;
+			}
+			if (_cache_stats) {
+				PrintCacheStats();
+			}
 
-		} else if (cmd == "learn") {
+		} else if (cmd == "follow") {
+#ifdef HAVE_FOLLOW
+			FollowLines in;
 			if (!_t) {
-				_t.reset(new AutoPatternsC::Trie);
+				ToggleExitCode(ECB_CMDLINE_ERROR);
+				std::cerr << "No trie for " << cmd << std::endl;
+
+			} else if (operands_count == 0) {
+				ToggleExitCode(ECB_CMDLINE_ERROR);
+				std::cerr << "-follow can be used only with input from file(s)" << std::endl;
+
+			} else for (int i = 0; i < operands_count; ++i) {
+				if (!in.Open(operands[i])) {
+					ToggleExitCode(ECB_READ_ERROR);
+					std::cerr << "Can't open: " << operands[i] << std::endl;
+				}
+			}
+			if (_t) {
+				FollowStream(in);
+			}
+#else
+			ToggleExitCode(ECB_CMDLINE_ERROR);
+			std::cerr << "-follow is not supported on this platform" << std::endl;
+#endif
+
+		} else if (cmd == "serve") {
+#ifdef HAVE_SERVER
+			if (CheckOperandsCount(cmd, 1, operands_count)) {
+				LineSocket::Serve(operands[0], [this](const std::string &request, std::string &reply) {
+					return ServeRequest(request, reply);
+				});
 			}
-			LoadLines lines;
+#else
+			ToggleExitCode(ECB_CMDLINE_ERROR);
+			std::cerr << "-serve is not supported on this platform" << std::endl;
+#endif
+
+		} else if (cmd == "request") {
+#ifdef HAVE_SERVER
 			if (operands_count == 0) {
-				lines.Load(std::cin);
+				ToggleExitCode(ECB_CMDLINE_ERROR);
+				std::cerr << "No socket for " << cmd << std::endl;
 
-			} else for (int i = 0; i < operands_count; ++i) {
-				std::ifstream is(operands[i]);
-				if (!is.is_open()) {
+			} else if (operands_count == 1) {
+				InputLines in;
+				in.OpenStdin();
+				Request(operands[0], in);
+
+			} else for (int i = 1; i < operands_count; ++i) {
+				InputLines in;
+				if (!in.Open(operands[i])) {
 					ToggleExitCode(ECB_READ_ERROR);
 					std::cerr << "Can't open: " << operands[i] << std::endl;
 				} else {
-					lines.Load(is);
+					Request(operands[0], in);
+				}
+			}
+#else
+			ToggleExitCode(ECB_CMDLINE_ERROR);
+			std::cerr << "-request is not supported on this platform" << std::endl;
+#endif
+
+		} else if (cmd == "learn") {
+			if (!_t) {
+				_t.reset(new AutoPatternsC::Trie);
+				_t->ShareSubtrees(_dag);
+			}
+			if (_learn_limit != 0) {
+				LearnBatch lb;
+				if (operands_count == 0) {
+					InputLines in;
+					in.OpenStdin();
+					LearnStream(lb, in);
+
+				} else for (int i = 0; i < operands_count; ++i) {
+					InputLines in;
+					if (!in.Open(operands[i])) {
+						ToggleExitCode(ECB_READ_ERROR);
+						std::cerr << "Can't open: " << operands[i] << std::endl;
+					} else {
+						LearnStream(lb, in);
+					}
+				}
+				LearnBatchFlush(lb);
+
+			} else {
+				LoadLines lines;
+				if (operands_count == 0) {
+					lines.LoadStdin();
+
+				} else for (int i = 0; i < operands_count; ++i) {
+					if (!lines.Load(operands[i])) {
+						ToggleExitCode(ECB_READ_ERROR);
+						std::cerr << "Can't open: " << operands[i] << std::endl;
+					}
 				}
+				_t->Learn(lines, _threads);
 			}
-			_t->Learn(lines);
 
 		} else if (cmd == "load") {
 			if (_t) {
@@ -299,14 +966,14 @@ class Commander
 
 			} else {
 				CheckOperandsCount(cmd, 1, operands_count);
-				std::ifstream is(operands[0]);
-				if (!is.is_open()) {
+				if (!LoadTrie(operands[0], _t, _t_input)) {
 					ToggleExitCode(ECB_READ_ERROR);
 					std::cerr << "Can't open: " << operands[0] << std::endl;
-				} else {
-					_t.reset(new AutoPatternsC::Trie(is));
 				}
 			}
+			if (_t && _dag) {
+				_t->ShareSubtrees();
+			}
 
 		} else if (cmd == "save" || cmd == "save-compact") {
 			if (!_t) {
@@ -317,6 +984,7 @@ class Commander
 				_t->Save(std::cout, cmd == "save-compact");
 
 			} else for (int i = 0; i < operands_count; ++i) {
+				DetachTrieInput(); // output may be the file trie is mapped from
 				std::ofstream os(operands[i]);
 				if (!os.is_open()) {
 					ToggleExitCode(ECB_WRITE_ERROR);
@@ -326,6 +994,25 @@ class Commander
 				}
 			}
 
+		} else if (cmd == "save-binary") {
+			if (!_t) {
+				ToggleExitCode(ECB_CMDLINE_ERROR);
+				std::cerr << "No trie for " << cmd << std::endl;
+
+			} else if (operands_count == 0) {
+				_t->SaveBinary(std::cout);
+
+			} else for (int i = 0; i < operands_count; ++i) {
+				DetachTrieInput(); // output may be the file trie is mapped from
+				std::ofstream os(operands[i], std::ios::binary);
+				if (!os.is_open()) {
+					ToggleExitCode(ECB_WRITE_ERROR);
+					std::cerr << "Can't create:" << operands[i] << std::endl;
+				} else {
+					_t->SaveBinary(os);
+				}
+			}
+
 		} else {
 			if (cmd != "help") {
 				std::cerr << "Bad argument: " << cmd << std::endl;
@@ -339,19 +1026,37 @@ class Commander
 	{
 		std::cerr << "Strange Tool by strangeCamel, BETA " << VERINFO << std::endl;
 		std::cerr << "Usage: strange"
-			<< " [-load TRIE_FILE] [-learn SAMPLES_FILE1 [SAMPLES_FILE2..]] [-descript] [-color] [-context [#]] [-eval SAMPLES_FILE1 [SAMPLES_FILE2..]] [-dialog SAMPLES_FILE1 [SAMPLES_FILE2..]] [-save TRIE_FILE] [-save-compact TRIE_FILE]"
+			<< " [-load TRIE_FILE] [-learn SAMPLES_FILE1 [SAMPLES_FILE2..]] [-descript] [-descript-budget #] [-color] [-context [#]] [-threads [#]] [-cache [#]] [-cache-stats] [-dag] [-learn-limit [#]] [-eval SAMPLES_FILE1 [SAMPLES_FILE2..]] [-dialog SAMPLES_FILE1 [SAMPLES_FILE2..]] [-follow SAMPLES_FILE1 [SAMPLES_FILE2..]] [-serve SOCKET] [-request SOCKET [REQUESTS_FILE1..]] [-save TRIE_FILE] [-save-compact TRIE_FILE] [-save-binary TRIE_FILE]"
 				<< std::endl;
 		std::cerr << "Operations are executed in exactly same order as specified by command line." << std::endl;
 		std::cerr << "Operations description:" << std::endl;
-		std::cerr << "  -load loads ready to use patterns from specified trie file. Loading discards any already existing in memory patterns (from previous load or learn operations)." << std::endl;
+		std::cerr << "  -load loads ready to use patterns from specified trie file (text or binary one). Loading discards any already existing in memory patterns (from previous load or learn operations)." << std::endl;
 		std::cerr << "  -learn learns samples from specified text file(s) or stdin if no files specified. If there're some already existing patterns in memory - learning will incrementally extend them, without discarding." << std::endl;
-		std::cerr << "  -descript enables per-token description of anomal lines found by -eval operation (can be slow)." << std::endl;
+		std::cerr << "  -descript enables per-token description of anomal lines found by -eval operation, showing their closest learned pattern." << std::endl;
+		std::cerr << "  -descript-budget limits search of closest pattern for each line by # explored states (K, M or G suffix can be used), so lines exhausting it get close but maybe not closest one. Results don't depend on timing. Default is 1M, 0 means unlimited." << std::endl;
 		std::cerr << "  -color enables using of ASCII colors in output of -eval operation." << std::endl;
 		std::cerr << "  -context makes -eval operation to print # number of lines before and after each mismatched line. If # is ALL then everything will be printed. If # is omitted - then its defaulted to 3 lines." << std::endl;
+		std::cerr << "  -threads makes -learn and -eval operations to use # threads, results stay the same as with single thread. If # is omitted - then its defaulted to amount of CPU cores." << std::endl;
+		std::cerr << "  -cache makes -eval operation to remember results of up to # recent lines, so repeating ones (also ones differing only by numbers where patterns allow that) avoid full matching. Results stay the same as without cache. If # is omitted - then its defaulted to 64K, 0 disables caching." << std::endl;
+		std::cerr << "  -cache-stats makes -eval operation to print to stderr hit rate of -cache." << std::endl;
+		std::cerr << "  -dag makes trie to keep structurally identical subtrees only once, both in memory used for evaluation and in files written by -save, -save-compact (such files can be loaded only by version supporting it) and -save-binary." << std::endl;
+		std::cerr << "  -learn-limit makes following -learn operations to read samples by batches of # bytes (K, M or G suffix can be used) and learn them one by one, to avoid keeping whole input in memory. Resulting patterns may slightly differ from learned at once. If # is omitted - then its defaulted to 64M, 0 disables batching." << std::endl;
 		std::cerr << "  -eval evaluates samples from specified text file(s) and prints results to stdout." << std::endl;
 		std::cerr << "  -dialog evaluates samples from specified text file(s) and prints results to stdout. Also learns samples, prompting if need to learn each unrecognized sample." << std::endl;
+		std::cerr << "  -follow evaluates lines appended to specified text file(s) like -eval does, waiting for new lines forever. Rotated files are reopened and truncated ones reread from beginning." << std::endl;
+		std::cerr << "  -serve keeps serving requests to named tries by Unix domain socket at specified path until killed. Each request is a line that gets single line reply:" << std::endl;
+		std::cerr << "    load NAME TRIE_FILE - loads trie from file (text or binary one) under given name, replacing existing one" << std::endl;
+		std::cerr << "    unload NAME - forgets named trie" << std::endl;
+		std::cerr << "    learn NAME SAMPLE - queues sample to be learned in background by named trie (creating empty one if need), evaluations use previous version of trie until learning completes" << std::endl;
+		std::cerr << "    eval NAME SAMPLE - evaluates sample replying 'match' or 'mismatch'" << std::endl;
+		std::cerr << "    descript NAME SAMPLE - same as eval, but 'mismatch' reply followed by description of sample like -descript shows" << std::endl;
+		std::cerr << "    save NAME [TRIE_FILE] - saves named trie in compact form into given file or into one it was loaded from, after learning all samples queued before" << std::endl;
+		std::cerr << "    quit - closes connection" << std::endl;
+		std::cerr << "    Failed requests get reply 'error' followed by reason. Many clients can be served at once, each one may send many requests before reading replies." << std::endl;
+		std::cerr << "  -request sends requests from specified file(s) or stdin to strange that serves specified socket and prints its replies to stdout." << std::endl;
 		std::cerr << "  -save saves existing in memory patterns into specified trie file with indentation for better readablity." << std::endl;
 		std::cerr << "  -save-compact saves existing in memory patterns into specified trie file in compact form to save space." << std::endl;
+		std::cerr << "  -save-binary saves existing in memory patterns into specified trie file in platform-dependent binary form that loads instantly." << std::endl;
 		std::cerr << "Exit code composed of following bits:" << std::endl;
 		std::cerr << std::dec;
 		std::cerr << "  " << ECB_ANOMALY << " if -eval used and found anomalies" << std::endl;
@@ -0,0 +1,299 @@
+#pragma once
+#include "utils.hpp"
+#include <stdint.h>
+#include <stddef.h>
+#include <vector>
+#include <algorithm>
+
+#if defined(__GNUC__) && defined(__x86_64__)
+# define HAVE_CHARCLASS_SIMD
+# include <immintrin.h>
+#endif
+
+struct AutoPatternsTokenizer : AutoPatternsUtils
+{
+
+// Characters classification for whole line at once: for each 64-chars
+// block produces bitmasks where bit N tells if character N of block
+// belongs to corresponding class. Classes are the same as IsAlphaDec,
+// IsDec, IsHex, IsSpace and IsPunctuation checks.
+// For single-byte characters it processes 16 (SSE2) or 32 (AVX2) chars
+// at a time, implementation selected at runtime by CPU capabilities.
+struct Block
+{
+	uint64_t aldec;  // latin letters, decimal digits or any non-ASCII
+	uint64_t alnum;  // latin letters or decimal digits
+	uint64_t dec;    // decimal digits
+	uint64_t hex;    // hexadecimal digits
+	uint64_t space;  // spaces and tabs
+	uint64_t punct;  // punctuation
+};
+
+typedef std::vector<Block> Blocks;
+
+template <class CharT>
+	static void ClassifyChars(Blocks &out, const CharT *s, size_t len)
+{
+	out.resize((len + 63) / 64);
+	for (size_t i = 0; i < len; i+= 64) {
+		ClassifyScalar(out[i / 64], s + i, (len - i < 64) ? len - i : 64);
+	}
+}
+
+static void ClassifyChars(Blocks &out, const char *s, size_t len)
+{
+	out.resize((len + 63) / 64);
+	const auto classify_block = BlockClassifier();
+	size_t i = 0;
+	for (; i + 64 <= len; i+= 64) {
+		classify_block(out[i / 64], s + i);
+	}
+	if (i < len) {
+		ClassifyScalar(out[i / 64], s + i, len - i);
+	}
+}
+
+private:
+
+template <class CharT>
+	static void ClassifyScalar(Block &b, const CharT *s, size_t len)
+{
+	b = Block{};
+	for (size_t i = 0; i != len; ++i) {
+		const auto c = s[i];
+		const uint64_t bit = ((uint64_t)1) << i;
+		if (IsAlphaDec(c)) {
+			b.aldec|= bit;
+			if (IsDec(c) || (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z')) {
+				b.alnum|= bit;
+			}
+			if (IsDec(c)) {
+				b.dec|= bit;
+			}
+			if (IsHex(c)) {
+				b.hex|= bit;
+			}
+
+		} else if (IsSpace(c)) {
+			b.space|= bit;
+
+		} else if (IsPunctuation(c)) {
+			b.punct|= bit;
+		}
+	}
+}
+
+static void ClassifyBlockScalar(Block &b, const char *s)
+{
+	ClassifyScalar(b, s, 64);
+}
+
+typedef void (*BlockClassifierFn)(Block &b, const char *s);
+
+#ifdef HAVE_CHARCLASS_SIMD
+
+// Chars compared as signed bytes, so any non-ASCII char is negative
+// and doesn't fall into any of ASCII ranges checked here.
+# define CHARCLASS_SIMD_BLOCK(VEC, SET1, CMPGT, CMPEQ, AND, OR, MOVEMASK) { \
+	const VEC v = in; \
+	const VEC lo = OR(v, SET1(0x20)); /* to lower case */ \
+	const VEC dec = AND(CMPGT(v, SET1('0' - 1)), CMPGT(SET1('9' + 1), v)); \
+	const VEC alpha = AND(CMPGT(lo, SET1('a' - 1)), CMPGT(SET1('z' + 1), lo)); \
+	const VEC hex_alpha = AND(CMPGT(lo, SET1('a' - 1)), CMPGT(SET1('f' + 1), lo)); \
+	const VEC alnum = OR(dec, alpha); \
+	const VEC space = OR(CMPEQ(v, SET1(' ')), CMPEQ(v, SET1('\t'))); \
+	VEC punct = CMPEQ(v, SET1('!')); \
+	punct = OR(punct, AND(CMPGT(v, SET1('#' - 1)), CMPGT(SET1('&' + 1), v))); \
+	punct = OR(punct, AND(CMPGT(v, SET1('(' - 1)), CMPGT(SET1('/' + 1), v))); \
+	punct = OR(punct, AND(CMPGT(v, SET1(':' - 1)), CMPGT(SET1(';' + 1), v))); \
+	punct = OR(punct, CMPEQ(v, SET1('='))); \
+	punct = OR(punct, CMPEQ(v, SET1('?'))); \
+	punct = OR(punct, CMPEQ(v, SET1('['))); \
+	punct = OR(punct, AND(CMPGT(v, SET1(']' - 1)), CMPGT(SET1('^' + 1), v))); \
+	punct = OR(punct, AND(CMPGT(v, SET1('{' - 1)), CMPGT(SET1('}' + 1), v))); \
+	const uint64_t high = (uint32_t)MOVEMASK(v); \
+	b.alnum|= ((uint64_t)(uint32_t)MOVEMASK(alnum)) << i; \
+	b.aldec|= (((uint64_t)(uint32_t)MOVEMASK(alnum)) | high) << i; \
+	b.dec|= ((uint64_t)(uint32_t)MOVEMASK(dec)) << i; \
+	b.hex|= ((uint64_t)(uint32_t)MOVEMASK(OR(dec, hex_alpha))) << i; \
+	b.space|= ((uint64_t)(uint32_t)MOVEMASK(space)) << i; \
+	b.punct|= ((uint64_t)(uint32_t)MOVEMASK(punct)) << i; \
+}
+
+static void ClassifyBlockSSE2(Block &b, const char *s)
+{
+	b = Block{};
+	for (size_t i = 0; i != 64; i+= 16) {
+		const __m128i in = _mm_loadu_si128((const __m128i *)(s + i));
+		CHARCLASS_SIMD_BLOCK(__m128i, _mm_set1_epi8, _mm_cmpgt_epi8, _mm_cmpeq_epi8,
+			_mm_and_si128, _mm_or_si128, _mm_movemask_epi8);
+	}
+}
+
+__attribute__((target("avx2")))
+	static void ClassifyBlockAVX2(Block &b, const char *s)
+{
+	b = Block{};
+	for (size_t i = 0; i != 64; i+= 32) {
+		const __m256i in = _mm256_loadu_si256((const __m256i *)(s + i));
+		CHARCLASS_SIMD_BLOCK(__m256i, _mm256_set1_epi8, _mm256_cmpgt_epi8, _mm256_cmpeq_epi8,
+			_mm256_and_si256, _mm256_or_si256, _mm256_movemask_epi8);
+	}
+}
+
+# undef CHARCLASS_SIMD_BLOCK
+
+static BlockClassifierFn BlockClassifier()
+{
+	static const BlockClassifierFn s_fn = __builtin_cpu_supports("avx2")
+		? ClassifyBlockAVX2 : ClassifyBlockSSE2;
+	return s_fn;
+}
+
+#else
+
+static BlockClassifierFn BlockClassifier()
+{
+	return ClassifyBlockScalar;
+}
+
+#endif
+
+static inline size_t LowestBitIndex(uint64_t v)
+{
+#ifdef __GNUC__
+	return __builtin_ctzll(v);
+#else
+	size_t out = 0;
+	for (; (v & 1) == 0; v>>= 1) {
+		++out;
+	}
+	return out;
+#endif
+}
+
+public:
+
+struct TokenSpan
+{
+	size_t offset;
+	size_t length;
+	mutable StringClass sc; // SCF_INVALID until requested by Tokenized::TokenClass
+};
+
+// Sample splitted into tokens - same sequences of either alphanumeric either
+// non-alphanumeric characters as repeated HeadingToken() would produce.
+// Splitting done once per sample, so matching logic addresses tokens by index.
+// Keep instance around and reuse it to avoid reallocations.
+template <class StringViewT>
+	struct Tokenized
+{
+	StringViewT line;
+	std::vector<TokenSpan> spans;
+	Blocks blocks;
+
+	void Assign(const StringViewT &s)
+	{
+		line = s;
+		spans.clear();
+		if (s.empty()) {
+			blocks.clear();
+			return;
+		}
+
+		// token boundaries are where alphanumeric bit differs from previous char's one
+		ClassifyChars(blocks, line.data(), line.size());
+		size_t start = 0;
+		uint64_t prev_aldec = blocks.front().aldec & 1;
+		for (size_t i = 0; i != blocks.size(); ++i) {
+			const uint64_t aldec = blocks[i].aldec;
+			uint64_t boundaries = aldec ^ ((aldec << 1) | prev_aldec);
+			prev_aldec = aldec >> 63;
+			if (i + 1 == blocks.size() && (s.size() % 64) != 0) {
+				boundaries&= (((uint64_t)1) << (s.size() % 64)) - 1;
+			}
+			for (; boundaries; boundaries&= boundaries - 1) {
+				const size_t pos = i * 64 + LowestBitIndex(boundaries);
+				spans.emplace_back(TokenSpan{start, pos - start, SCF_INVALID});
+				start = pos;
+			}
+		}
+		spans.emplace_back(TokenSpan{start, s.size() - start, SCF_INVALID});
+	}
+
+	inline size_t size() const
+	{
+		return spans.size();
+	}
+
+	// returns empty token for index that is out of range
+	inline StringViewT Token(size_t i) const
+	{
+		return (i < spans.size()) ? line.substr(spans[i].offset, spans[i].length) : StringViewT();
+	}
+
+	// same as ClassifyString(Token(i)) but using characters classes bitmasks
+	StringClass TokenClass(size_t i) const
+	{
+		const auto &span = spans[i];
+		if (span.sc != SCF_INVALID) {
+			return span.sc;
+		}
+
+		uint64_t any_aldec = 0, any_dec = 0, any_hex = 0, any_space = 0, any_punct = 0;
+		uint64_t any_unspecified = 0, any_not_dec = 0, any_not_hex = 0, any_not_alnum = 0;
+		for (size_t pos = span.offset, end = span.offset + span.length; pos < end; ) {
+			const auto &b = blocks[pos / 64];
+			const size_t shift = pos % 64;
+			const size_t count = std::min((size_t)64 - shift, end - pos);
+			const uint64_t m = ((count < 64) ? ((((uint64_t)1) << count) - 1) : ~(uint64_t)0) << shift;
+			any_aldec|= b.aldec & m;
+			any_dec|= b.dec & m;
+			any_hex|= b.hex & m;
+			any_space|= b.space & m;
+			any_punct|= b.punct & m;
+			any_unspecified|= ~(b.aldec | b.space | b.punct) & m;
+			any_not_dec|= b.aldec & ~b.dec & m;
+			any_not_hex|= b.aldec & ~b.hex & m;
+			any_not_alnum|= (b.aldec & ~b.alnum) & m;
+			pos+= count;
+		}
+
+		const auto &token = Token(i);
+		if (any_aldec && !any_not_alnum && !any_dec && span.length >= 3 && span.length <= 9) {
+			// only latin letters - may be calendar name, let full check to handle it
+			span.sc = ClassifyString(token);
+
+		} else if (any_not_hex && (token[0] == 'x' || (token.size() > 1 && token[1] == 'x'))) {
+			// may be hexadecimal with 0x prefix, let full check to handle it
+			span.sc = ClassifyString(token);
+
+		} else {
+			StringClass mods = 0;
+			if (any_space) {
+				mods|= SCF_SPACES;
+			}
+			if (any_punct) {
+				mods|= SCF_PUNCTUATION;
+			}
+			if (any_unspecified) {
+				mods|= SCF_UNSPECIFIED;
+			}
+			if (any_dec && !any_not_dec) {
+				span.sc = SCF_DIGITS_DECIMAL | mods;
+
+			} else if (any_hex && !any_not_hex) {
+				span.sc = SCF_DIGITS_HEXADECIMAL | mods;
+
+			} else if (any_aldec && !any_not_alnum) {
+				span.sc = SCF_ALPHADEC | mods;
+
+			} else {
+				span.sc = SCF_NO_ALNUM | mods;
+			}
+		}
+		return span.sc;
+	}
+};
+
+};
@@ -1,371 +1,487 @@
 #pragma once
 #include "utils.hpp"
+#include "pool.hpp"
 #include <set>
+#include <mutex>
 #include <algorithm>
+#include <string>
+#include <stdexcept>
 
 template <class String, class StringView, class IStream, class OStream>
 	struct AutoPatternsTokens : AutoPatternsUtils
 {
 
+typedef typename String::value_type CharT;
+
+// string kept by token, allocated by arena of trie that token belongs to
+typedef std::basic_string<CharT, std::char_traits<CharT>, AutoPatternsArenaAllocator<CharT> > TokenValue;
+
+// appends decimal representation of given number
+static void AppendNumber(String &out, size_t n)
+{
+	char digits[24];
+	size_t i = sizeof(digits);
+	do {
+		digits[--i] = '0' + (n % 10);
+		n/= 10;
+	} while (n);
+	out.append(digits + i, digits + sizeof(digits));
+}
+
+// Token is a tagged value: depending on its kind it matches either exact string,
+// either any string of given class and length range, either string with numbers
+// by its sequence. Its kept by value inside nodes and dispatched by switch, so
+// hot paths like exact string matching get inlined. TokenString, TokenStringClass
+// and TokenStringWithNumbers only construct tokens of corresponding kind.
 struct Token
 {
-	virtual ~Token() {}
-	virtual bool Match(const StringView &value) const = 0;
-	virtual void Serialize(OStream &os) const = 0;
+	TokenKind Kind() const { return _kind; }
+
+	bool Match(const StringView &value) const
+	{
+		switch (_kind) {
+			case TK_STRING:
+				return (value.size() == ValuePtr()->size()
+					&& std::char_traits<CharT>::compare(value.data(), ValuePtr()->data(), value.size()) == 0);
+			case TK_STRING_CLASS:
+				return MatchStringClass(value, _sc, _min_len, _max_len);
+			case TK_STRING_WITH_NUMBERS:
+				return MatchStringWithNumbers(_value, _max_len, value);
+		}
+		return false;
+	}
+
+	/// Appends serialized token followed by newline to given output
+	void Serialize(String &out) const
+	{
+		switch (_kind) {
+			case TK_STRING:
+				out+= '$';
+				out.append(ValuePtr()->data(), ValuePtr()->size());
+				break;
+			case TK_STRING_CLASS:
+				out+= '?';
+				AppendNumber(out, _sc);
+				out+= ':';
+				AppendNumber(out, _min_len);
+				out+= ':';
+				AppendNumber(out, _max_len);
+				break;
+			case TK_STRING_WITH_NUMBERS:
+				out+= '!';
+				AppendNumber(out, _max_len);
+				out+= ':';
+				out.append(_value.data(), _value.size());
+				break;
+		}
+		out+= '\n';
+	}
+
+	// Equals() gives same result as comparing Serialize() outputs, Hash() consistent with it
+	size_t Hash() const
+	{
+		switch (_kind) {
+			case TK_STRING:
+				return HashString(*ValuePtr());
+			case TK_STRING_CLASS:
+				return ((((size_t)_sc * 31) + _min_len) * 31 + _max_len) * 31 + TK_STRING_CLASS;
+			case TK_STRING_WITH_NUMBERS:
+				return (HashString(_value) * 31 + _max_len) * 31 + TK_STRING_WITH_NUMBERS;
+		}
+		return 0;
+	}
+
+	bool Equals(const Token &other) const
+	{
+		if (other._kind != _kind) {
+			return false;
+		}
+		switch (_kind) {
+			case TK_STRING:
+				return ValuePtr() == other.ValuePtr() || *ValuePtr() == *other.ValuePtr();
+			case TK_STRING_CLASS:
+				return other._sc == _sc && other._min_len == _min_len && other._max_len == _max_len;
+			case TK_STRING_WITH_NUMBERS:
+				return other._max_len == _max_len && other._value == _value;
+		}
+		return false;
+	}
+
+	StringClass GetStringClass() const
+	{
+		if (_kind == TK_STRING && _sc == SCF_INVALID) {
+			_sc = ClassifyString(*ValuePtr());
+		}
+		return _sc;
+	}
+
+	size_t GetLengthMin() const
+	{
+		switch (_kind) {
+			case TK_STRING:
+				return ValuePtr()->size();
+			case TK_STRING_WITH_NUMBERS:
+				return _value.size();
+			default:
+				return _min_len;
+		}
+	}
+
+	size_t GetLengthMax() const
+	{
+		return (_kind == TK_STRING) ? ValuePtr()->size() : _max_len;
+	}
+
+	const TokenValue *GetString() const
+	{
+		return (_kind == TK_STRING) ? ValuePtr() : nullptr;
+	}
+
+	/// Valid only for TK_STRING_WITH_NUMBERS
+	const TokenValue &GetSequence() const
+	{
+		return _value;
+	}
+
+protected:
+	TokenKind _kind = TK_STRING;
+	mutable StringClass _sc = SCF_INVALID; // for TK_STRING its lazily classified value
+	size_t _min_len = 0, _max_len = (size_t)-1;
+	TokenValue _value; // exact string (unless interned) or sequence of TK_STRING_WITH_NUMBERS
+
+#ifdef STRINGS_INTERNING
+	const TokenValue *_interned = nullptr;
+
+	inline const TokenValue *ValuePtr() const { return (_kind == TK_STRING && _interned) ? _interned : &_value; }
+
+	void SetValue(const StringView &value)
+	{
+		static std::set<TokenValue, std::less<> > s_interned_strings;
+		static std::mutex s_interned_strings_mutex; // tokens may be created by parallel learning
+		std::lock_guard<std::mutex> lock(s_interned_strings_mutex);
+		auto it = s_interned_strings.find(value);
+		if (it != s_interned_strings.end()) {
+			_interned = &(*it);
+		} else {
+			AutoPatternsArena::Scope scope(nullptr); // interned strings outlive tries
+			auto ir = s_interned_strings.emplace(value.data(), value.size());
+			_interned = &(*ir.first);
+		}
+	}
 
-	virtual StringClass GetStringClass() const { return SCF_INVALID; }
-	virtual size_t GetLengthMin() const { return 0; }
-	virtual size_t GetLengthMax() const { return (size_t)-1; }
+#else
+	inline const TokenValue *ValuePtr() const { return &_value; }
 
-	virtual const String *GetString() const { return nullptr; } // TODO: do something better
+	void SetValue(const StringView &value)
+	{
+		_value.assign(value.data(), value.size());
+	}
+#endif
 };
 
 struct Node;
 
 typedef std::unique_ptr<Node> NodePtr;
-typedef std::vector<NodePtr> Nodes;
+typedef std::vector<NodePtr, AutoPatternsArenaAllocator<NodePtr> > Nodes;
 
+// Parses text representation of trie kept in memory line by line, yielding
+// depth, lead character and remaining data of each non-empty line.
+// Malformed input reported by exceptions telling number of bad line.
 struct Deserializer
 {
 	size_t depth = 0;
-	char lead = 0;
-	String data;
+	CharT lead = 0; // zero at end of input
+	StringView data;
+	bool references; // if shared kidz lists labeling and references allowed
+	std::vector<const Node *> labeled; // nodes which kidz lists labeled, by labels, nullptr while incomplete
 
-	Deserializer(IStream &is) : _is(is) { }
+	Deserializer(const CharT *begin, const CharT *end, size_t first_line, bool references_)
+		: references(references_), _cur(begin), _end(end), _line(first_line - 1) { }
 
 	void Fetch()
 	{
-		data.clear();
-		depth = 0;
-		while (_is.get(lead)) {
-			if (lead == ' ') {
-				++depth;
-
-			} else if (lead >= '0' && lead<= '9') {
-				depth*= 10;
-				depth+= lead - '0';
+		while (_cur != _end) {
+			++_line;
+			const CharT *eol = std::char_traits<CharT>::find(_cur, _end - _cur, '\n');
+			const CharT *p = _cur, *e = eol ? eol : _end;
+			_cur = eol ? eol + 1 : _end;
+			while (e != p && IsEOL(e[-1])) {
+				--e;
+			}
+			depth = 0;
+			for (; p != e; ++p) {
+				if (*p == ' ') {
+					++depth;
 
-			} else if (IsEOL(lead)) {
-				// skip empty lines
-				depth = 0;
+				} else if (*p >= '0' && *p <= '9') {
+					depth = depth * 10 + (*p - '0');
 
-			} else {
-				char c;
-				while (_is.get(c) && !IsEOL(c)) {
-					data+= c;
+				} else {
+					break;
 				}
+			}
+			if (p != e) { // otherwise skip empty line
+				lead = *p;
+				data = StringView(p + 1, e - p - 1);
 				return;
 			}
 		}
 		lead = 0;
 	}
 
+	/// Parses decimal number at given position of data that must be followed by
+	/// separator or by end of data if separator is zero, skipping separator
+	template <class IntT>
+		IntT Number(size_t &pos, CharT separator, const char *what) const
+	{
+		const size_t start = pos;
+		IntT out = 0;
+		for (; pos < data.size() && data[pos] >= '0' && data[pos] <= '9'; ++pos) {
+			out = out * 10 + (data[pos] - '0');
+		}
+		if (pos == start || (separator ? (pos == data.size() || data[pos] != separator) : pos != data.size())) {
+			throw Error(what);
+		}
+		if (separator) {
+			++pos;
+		}
+		return out;
+	}
+
+	std::runtime_error Error(const char *what) const
+	{
+		return std::runtime_error(std::string("trie line ") + std::to_string(_line) + ": " + what);
+	}
+
 private:
-	IStream &_is;
+	const CharT *_cur, *_end;
+	size_t _line; // number of line of fetched data
 };
 
-struct Node
+struct Node : AutoPatternsArenaAllocated
 {
-	std::unique_ptr<Token> token;
+	Token token;
 	Nodes kidz;
+	bool dirty = true; // kidz subtrees changed since last convergence
+
+	/// Must be called on any change of kidz subtrees
+	void MarkChanged()
+	{
+		_hash = 0;
+		dirty = true;
+	}
+
+	/// Hash of kidz subtrees, consistent with KidzEqual().
+	/// Its cached, so InvalidateHash() must be called on any change of kidz subtrees.
+	size_t KidzHash() const
+	{
+		if (_hash == 0) {
+			size_t h = kidz.size();
+			for (const auto &kid : kidz) {
+				h = (h * 1000003) ^ (kid->token.Hash() * 31 + kid->KidzHash());
+			}
+			_hash = h ? h : 1;
+		}
+		return _hash;
+	}
+
+	void InvalidateHash()
+	{
+		_hash = 0;
+	}
+
+	/// Gives same result as comparing Serialize() outputs of nodes
+	bool KidzEqual(const Node &other) const
+	{
+		if (this == &other) {
+			return true;
+		}
+		if (kidz.size() != other.kidz.size() || KidzHash() != other.KidzHash()) {
+			return false;
+		}
+		for (size_t i = 0; i != kidz.size(); ++i) {
+			if (!kidz[i]->token.Equals(other.kidz[i]->token) || !kidz[i]->KidzEqual(*other.kidz[i])) {
+				return false;
+			}
+		}
+		return true;
+	}
 
-	void Serialize(OStream &os, bool compact) const
+	/// Makes kidz to be deep copy of given node's kidz
+	void CopyKidz(const Node &other)
 	{
-		for (const auto &kid : kidz) {
-			kid->SerializeInner(os, compact, 0);
+		kidz.reserve(kidz.size() + other.kidz.size());
+		for (const auto &kid : other.kidz) {
+			kidz.emplace_back(new Node);
+			kidz.back()->token = kid->token;
+			kidz.back()->dirty = kid->dirty;
+			kidz.back()->CopyKidz(*kid);
 		}
 	}
 
-	void Deserialize(IStream &is)
+	/// Parses kidz from text representation of trie, throws on malformed input.
+	/// Given number of first line is used only to report errors. If references
+	/// allowed then kidz lists may be labeled by '&' line and then copied by '*' line.
+	void Deserialize(const CharT *begin, const CharT *end, size_t first_line, bool references = false)
 	{
-		Deserializer des(is);
+		Deserializer des(begin, end, first_line, references);
 		des.Fetch();
 		DeserializeInner(des, 0);
 	}
 
 private:
+	// Saved chains of string tokens coalesced into single one are exploded back into
+	// nested heading tokens here. Stored trie was converged before saving, so resulting
+	// nodes marked as not dirty.
 	void DeserializeInner(Deserializer &des, size_t depth)
 	{
+		Node *tail = nullptr; // last node of chain produced by last fetched line
+		size_t label = (size_t)-1;
 		while (des.lead) {
 			if (des.depth > depth) {
-				assert(des.depth == depth + 1);
-				assert(!kidz.empty());
-				kidz.back()->DeserializeInner(des, depth + 1);
+				if (des.depth != depth + 1 || !tail) {
+					throw des.Error("unexpected depth");
+				}
+				tail->DeserializeInner(des, depth + 1);
 				continue;
 			}
 			if (des.depth < depth) {
 				break;
 			}
+			if (des.references && (des.lead == '&' || des.lead == '*')) {
+				const bool reference = (des.lead == '*');
+				DeserializeReference(des, label);
+				des.Fetch();
+				if (reference && des.lead && des.depth >= depth) {
+					throw des.Error("unexpected line after reference");
+				}
+				tail = nullptr;
+				continue;
+			}
 			kidz.emplace_back(new Node);
+			tail = kidz.back().get();
+			tail->dirty = false;
+			size_t pos = 0;
 			switch (des.lead) {
 				case '$': {
-					kidz.back()->token.reset(new TokenString(des));
+					StringView value = des.data;
+					for (;;) {
+						const StringView head = (value.size() > 1) ? HeadingToken(value) : value;
+						tail->token = TokenString(head);
+						if (head.size() == value.size()) {
+							break;
+						}
+						value = value.substr(head.size());
+						tail->kidz.emplace_back(new Node);
+						tail = tail->kidz.back().get();
+						tail->dirty = false;
+					}
 				} break;
 				case '?': {
-					kidz.back()->token.reset(new TokenStringClass(des));
+					const auto sc = des.template Number<StringClass>(pos, ':', "bad class");
+					const auto min_len = des.template Number<size_t>(pos, ':', "bad min length");
+					const auto max_len = des.template Number<size_t>(pos, 0, "bad max length");
+					tail->token = TokenStringClass(sc, min_len, max_len);
 				} break;
 				case '!': {
-					kidz.back()->token.reset(new TokenStringWithNumbers(des));
+					const auto max_len = des.template Number<size_t>(pos, ':', "bad max length");
+					tail->token = TokenStringWithNumbers(des.data.substr(pos), max_len, true);
 				} break;
-				default: {
-					kidz.pop_back();
-					std::cerr << __FUNCTION__ << ": bad lead=" << des.lead << std::endl;
-				}
+				default:
+					throw des.Error("bad token kind");
 			}
 			des.Fetch();
-		}		
+		}
+		if (label != (size_t)-1) {
+			des.labeled[label] = this;
+		}
 	}
 
-	void SerializeInner(OStream &os, bool compact, size_t depth) const
+	void DeserializeReference(Deserializer &des, size_t &label)
 	{
-		if (compact) {
-			os << std::dec << depth;
-
-		} else for (size_t i = 0; i != depth; ++i) {
-			os << ' ';
+		if (!kidz.empty()) {
+			throw des.Error("reference must be first kid");
+		}
+		size_t pos = 0;
+		const auto id = des.template Number<size_t>(pos, 0, "bad label");
+		if (des.lead == '&') {
+			if (id != des.labeled.size() || label != (size_t)-1) {
+				throw des.Error("unexpected label");
+			}
+			des.labeled.emplace_back(nullptr);
+			label = id;
+			return;
 		}
-		token->Serialize(os);
-		for (const auto &kid : kidz) {
-			kid->SerializeInner(os, compact, depth + 1);
+		if (id >= des.labeled.size() || !des.labeled[id]) {
+			throw des.Error("reference to undefined label");
 		}
+		CopyKidz(*des.labeled[id]);
 	}
+
+	mutable size_t _hash = 0;
 };
 
 struct TokenString : Token
 {
 	TokenString(const StringView &value)
 	{
-#ifdef STRINGS_INTERNING
-		InternValue(value);
-#else
-		_value = value;
-#endif
-	}
-
-	TokenString(Deserializer &des)
-	{
-#ifdef STRINGS_INTERNING
-		InternValue(des.data);
-#else
-		_value = std::move(des.data);
-		des.data.clear();
-#endif
-	}
-
-	virtual bool Match(const StringView &value) const
-	{
-		return (value.size() == ValuePtr()->size() && value == *ValuePtr());
-	}
-
-	virtual void Serialize(OStream &os) const
-	{
-		os << '$' << *ValuePtr() << std::endl;
-	}
-
-	virtual StringClass GetStringClass() const
-	{
-		if (_sc == SCF_INVALID) {
-			_sc = ClassifyString(*ValuePtr());
-		}
-		return _sc;
-	}
-
-	virtual size_t GetLengthMin() const
-	{
-		return ValuePtr()->size();
-	}
-
-	virtual size_t GetLengthMax() const
-	{
-		return ValuePtr()->size();
-	}
-
-	virtual const String *GetString() const
-	{
-		return ValuePtr();
-	}
-
-private:
-#ifdef STRINGS_INTERNING
-	const String *_value = nullptr;
-	inline const String *ValuePtr() const { return _value; }
-
-	void InternValue(const StringView &value)
-	{
-		static std::set<String, std::less<> > s_interned_strings;
-		auto it = s_interned_strings.find(value);
-		if (it != s_interned_strings.end()) {
-			_value = &(*it);
-		} else {
-			auto ir = s_interned_strings.emplace(value);
-			_value = &(*ir.first);
-		}
+		this->SetValue(value);
 	}
-
-#else
-	String _value;
-	inline const String *ValuePtr() const { return &_value; }
-#endif
-	mutable StringClass _sc = SCF_INVALID;
 };
 
 struct TokenStringClass : Token
 {
-	TokenStringClass(Deserializer &des)
-	{
-		size_t pos = 0;
-		if (!SkipNonAlphaNum(des.data, pos)) {
-			throw std::runtime_error("TokenStringClass: no class in serialized data");
-		}
-		_sc = ParseDecAsInt<StringClass>(des.data, pos);
-		if (!SkipNonAlphaNum(des.data, pos)) {
-			throw std::runtime_error("TokenStringClass: no min_len in serialized data");
-		}
-		_min_len = ParseDecAsInt<size_t>(des.data, pos);
-		if (!SkipNonAlphaNum(des.data, pos)) {
-			throw std::runtime_error("TokenStringClass: no max_len in serialized data");
-		}
-		_max_len = ParseDecAsInt<size_t>(des.data, pos);
-	}
-
 	TokenStringClass(StringClass sc, size_t min_len, size_t max_len)
-		:
-		_sc(sc),
-		_min_len(min_len),
-		_max_len(max_len)
-	{
-	}
-
-	virtual bool Match(const StringView &value) const
-	{
-		return value.size() >= _min_len && value.size() <= _max_len && StringFitsClass(value, _sc);
-	}
-
-	virtual void Serialize(OStream &os) const
-	{
-		os << '?' << _sc << ':' << _min_len << ':' << _max_len << std::endl;
-	}
-
-
-	virtual StringClass GetStringClass() const
-	{
-		return _sc;
-	}
-
-	virtual size_t GetLengthMin() const
-	{
-		return _min_len;
-	}
-
-	virtual size_t GetLengthMax() const
 	{
-		return _max_len;
+		this->_kind = TK_STRING_CLASS;
+		this->_sc = sc;
+		this->_min_len = min_len;
+		this->_max_len = max_len;
 	}
-
-private:
-	StringClass _sc = SCF_INVALID;
-	size_t _min_len, _max_len;
 };
 
 
 struct TokenStringWithNumbers : Token
 {
-	TokenStringWithNumbers() = default;
-
-	TokenStringWithNumbers(Deserializer &des)
+	TokenStringWithNumbers()
 	{
-		size_t pos = 0;
-		if (!SkipNonAlphaNum(des.data, pos)) {
-			throw std::runtime_error("TokenStringClass: no max_len in serialized data");
-		}
-		_max_len = ParseDecAsInt<size_t>(des.data, pos);
-		if (pos == des.data.size() || des.data[pos] != ':') {
-			throw std::runtime_error("TokenStringClass: no sequence in serialized data");
-		}
-		_sequence = des.data.substr(pos + 1);
+		this->_kind = TK_STRING_WITH_NUMBERS;
 	}
 
 	TokenStringWithNumbers(const StringView &s, size_t max_len = (size_t)-1)
+		: TokenStringWithNumbers()
 	{
 		Reinit(s, max_len);
 	}
 
+	// constructs from already prepared sequence, see GetSequence()
+	TokenStringWithNumbers(const StringView &sequence, size_t max_len, bool)
+		: TokenStringWithNumbers()
+	{
+		this->_max_len = max_len;
+		this->_value.assign(sequence.data(), sequence.size());
+	}
+
 	void Reinit(const StringView &s, size_t max_len = (size_t)-1)
 	{
-		_max_len = max_len;
-		_sequence.clear();
-		_sequence.reserve(s.size());
+		auto &sequence = this->_value;
+		this->_max_len = max_len;
+		sequence.clear();
+		sequence.reserve(s.size());
 		for (const auto &c : s) {
 			if (c == '#') {
-				_sequence+= '_';
+				sequence+= '_';
 
 			} else if (IsHex(c)) {
-				if (_sequence.empty() || _sequence.back() != '#') {
-					_sequence+= '#';
+				if (sequence.empty() || sequence.back() != '#') {
+					sequence+= '#';
 				}
 
 			} else {
-				_sequence+= c;
-			}
-		}
-	}
-
-	virtual bool Match(const StringView &value) const
-	{
-		if (value.size() < _sequence.size() || value.size() > _max_len) {
-			return false;
-		}
-
-		auto seq_it = _sequence.begin();
-		bool prev_matched_num = false;
-		for (auto c : value) {
-			if (seq_it == _sequence.end()) {
-				return false;
+				sequence+= c;
 			}
-			prev_matched_num = false;
-			if (*seq_it == '#') {
-				if (IsHex(c)) {
-					prev_matched_num = true;
-					continue;
-				}
-				++seq_it;
-				if (seq_it == _sequence.end()) {
-					return false;
-				}
-			}
-			if (*seq_it != c && (c != '#' || *seq_it != '_')) {
-				return false;
-			}
-			++seq_it;
-		}
-
-		return (seq_it == _sequence.end()
-			|| (prev_matched_num && *seq_it == '#' && (seq_it + 1) == _sequence.end()));
-	}
-
-	virtual void Serialize(OStream &os) const
-	{
-		os << '!' << _max_len << ':';
-		for (const auto &c : _sequence) {
-			os << c;
 		}
-		os << std::endl;
-	}
-
-	virtual size_t GetLengthMin() const
-	{
-		return _sequence.size();
 	}
-
-	virtual size_t GetLengthMax() const
-	{
-		return _max_len;
-	}
-
-private:
-	size_t _max_len = (size_t)-1;
-	String _sequence;
 };
 
 };
-
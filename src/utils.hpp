@@ -1,6 +1,10 @@
 #pragma once
 #include <math.h>
+#include <stdint.h>
 #include <unordered_set>
+#include <vector>
+#include <thread>
+#include <atomic>
 
 struct AutoPatternsUtils
 {
@@ -65,6 +69,21 @@ enum StringClassFeats
 	SCF_INVALID        = 0xffffffff
 };
 
+enum TokenKind : unsigned char
+{
+	TK_STRING = 0,            // matches exactly same string
+	TK_STRING_CLASS,          // matches any string of given class and length
+	TK_STRING_WITH_NUMBERS    // matches string with same non-numeric characters
+};
+
+enum TokenStatus : unsigned char
+{
+	TS_MATCH = 0,
+	TS_MISMATCH,
+	TS_REDUNDANT,
+	TS_MISSING
+};
+
 ////////////
 template <class VectorT>
 	static void SortAndUniq(VectorT &v)
@@ -75,6 +94,27 @@ template <class VectorT>
 }
 
 
+// invokes fn(i) for each i in [0..count) using up to given amount of threads
+template <class FN>
+	static void ParallelFor(size_t count, size_t threads, const FN &fn)
+{
+	std::atomic<size_t> next{0};
+	auto worker = [&]() {
+		for (size_t i; (i = next++) < count; ) {
+			fn(i);
+		}
+	};
+
+	std::vector<std::thread> workers;
+	for (size_t i = 1; i < threads && i < count; ++i) {
+		workers.emplace_back(worker);
+	}
+	worker();
+	for (auto &w : workers) {
+		w.join();
+	}
+}
+
 // some heuristics that returns true if incoming string looks as randomly generated sequence
 // like session ID etc
 template <class StringT>
@@ -345,8 +385,13 @@ template <class StringT>
 template <class StringT>
 	static bool StringFitsClass(const StringT &s, StringClass sc)
 {
-	StringClass sc_s = ClassifyString(s);
+	return StringFitsClass(s, ClassifyString(s), sc);
+}
 
+// same as above but with already known class of given string
+template <class StringT>
+	static bool StringFitsClass(const StringT &s, StringClass sc_s, StringClass sc)
+{
 	// if sc specifies some calendar name - sc_s should fall into
 	// some of specified calendar category
 	if ((sc & (SCF_WEEKDAY | SCF_MONTH)) != 0) {
@@ -372,6 +417,57 @@ template <class StringT>
 	return true;
 }
 
+template <class StringT>
+	static bool MatchStringClass(const StringT &value, StringClass sc, size_t min_len, size_t max_len)
+{
+	return value.size() >= min_len && value.size() <= max_len && StringFitsClass(value, sc);
+}
+
+// sequence is a string where each run of hexadecimal characters replaced with single '#'
+// and each '#' of original string replaced with '_', see TokenStringWithNumbers::Reinit
+template <class SequenceT, class StringT>
+	static bool MatchStringWithNumbers(const SequenceT &sequence, size_t max_len, const StringT &value)
+{
+	if (value.size() < sequence.size() || value.size() > max_len) {
+		return false;
+	}
+
+	auto seq_it = sequence.begin();
+	bool prev_matched_num = false;
+	for (auto c : value) {
+		if (seq_it == sequence.end()) {
+			return false;
+		}
+		prev_matched_num = false;
+		if (*seq_it == '#') {
+			if (IsHex(c)) {
+				prev_matched_num = true;
+				continue;
+			}
+			++seq_it;
+			if (seq_it == sequence.end()) {
+				return false;
+			}
+		}
+		if (*seq_it != c && (c != '#' || *seq_it != '_')) {
+			return false;
+		}
+		++seq_it;
+	}
+
+	return (seq_it == sequence.end()
+		|| (prev_matched_num && *seq_it == '#' && (seq_it + 1) == sequence.end()));
+}
+
+// returns true if HeadingToken(sample) == head but without scanning whole heading token
+template <class StringT>
+	static bool HasHeadingToken(const StringT &sample, const StringT &head)
+{
+	return sample.size() > head.size()
+		&& IsAlphaDec(sample[head.size()]) != IsAlphaDec(head[0])
+		&& sample.compare(0, head.size(), head) == 0;
+}
+
 template <class StringT>
 	static StringT HeadingToken(const StringT &sample)
 {
@@ -386,4 +482,24 @@ template <class StringT>
 
 	return out;
 }
+
+// FNV-1a hash of string, stable across runs and platforms with same char size
+template <class StringT>
+	static uint32_t HashString(const StringT &s)
+{
+	uint32_t out = 2166136261u;
+	for (const auto &c : s) {
+		out = (out ^ (uint32_t)c) * 16777619u;
+	}
+	return out;
+}
+
+template <class StringT>
+	struct StringHasher
+{
+	size_t operator()(const StringT &s) const
+	{
+		return HashString(s);
+	}
+};
 };
@@ -3,6 +3,8 @@
 TMP=/tmp/strange.$$.tmp
 TRIE=/tmp/strange.$$.trie
 OUT=/tmp/strange.$$.out
+ALT_OUT=/tmp/strange.$$.alt.out
+ALT_TRIE=/tmp/strange.$$.alt.trie
 
 FAILED=0
 
@@ -49,23 +51,245 @@ function Test_Eval
 	fi
 }
 
+function Test_Threads
+{
+	for f in eval-match eval-mismatch; do
+		"$RESULTS/strange" -load "$TRIE" -descript -context 2 -eval "$1/$f" > "$TMP"
+		EC=$?
+		"$RESULTS/strange" -load "$TRIE" -threads 3 -descript -context 2 -eval "$1/$f" > "$ALT_OUT"
+		if [ $? -ne $EC ] || ! cmp -s "$TMP" "$ALT_OUT"; then
+			Test_Failed "$1" "threaded eval differs: $f"
+		fi
+	done
+	rm -f "$ALT_OUT"
+}
+
+function Test_DescriptBudget
+{
+	"$RESULTS/strange" -load "$TRIE" -descript -descript-budget 100 -eval "$1/eval-mismatch" > "$TMP" 2>/dev/null
+	EC=$?
+	"$RESULTS/strange" -load "$TRIE" -threads 3 -descript -descript-budget 100 -eval "$1/eval-mismatch" > "$ALT_OUT" 2>/dev/null
+	if [ $? -ne $EC ] || ! cmp -s "$TMP" "$ALT_OUT"; then
+		Test_Failed "$1" "budgeted descript differs"
+	fi
+	rm -f "$ALT_OUT"
+}
+
+function Test_Cache
+{
+	cat "$1/eval-match" "$1/eval-mismatch" "$1/eval-match" "$1/eval-mismatch" > "$TMP"
+	"$RESULTS/strange" -load "$TRIE" -context ALL -eval "$TMP" > "$OUT.cache"
+	EC=$?
+	for args in "-cache 16" "-cache -threads 3"; do
+		"$RESULTS/strange" -load "$TRIE" $args -context ALL -eval "$TMP" > "$ALT_OUT"
+		if [ $? -ne $EC ] || ! cmp -s "$OUT.cache" "$ALT_OUT"; then
+			Test_Failed "$1" "cached eval differs: $args"
+		fi
+	done
+	# digits may change token class, so cached match of '0x3a' must not apply to '1x3a'
+	printf 'addr 0x1f end\naddr 0x2a end\naddr 0x9c end\naddr 0x4d end\naddr 0x77 end\n' > "$TMP"
+	printf 'addr 0x3a end\naddr 1x3a end\n' > "$ALT_OUT"
+	"$RESULTS/strange" -learn "$TMP" -eval "$ALT_OUT" > /dev/null
+	EC=$?
+	"$RESULTS/strange" -cache -learn "$TMP" -eval "$ALT_OUT" > /dev/null
+	if [ $? -ne $EC ]; then
+		Test_Failed "$1" "cached eval ignores token class change"
+	fi
+	rm -f "$OUT.cache" "$ALT_OUT"
+}
+
+function Test_Follow
+{
+	"$RESULTS/strange" -load "$TRIE" -descript -context ALL -eval "$1/eval-match" "$1/eval-mismatch" > "$OUT.follow"
+	: > "$TMP"
+	"$RESULTS/strange" -load "$TRIE" -descript -context ALL -follow "$TMP" > "$ALT_OUT" &
+	PID=$!
+	# follower starts at end of file, so append mismatching sentinel lines until its reporting them,
+	# each one reported by same output line that is skipped then
+	for i in `seq 50`; do
+		echo "strange-follow-sentinel" >> "$TMP"
+		sleep 0.1
+		if [ -s "$ALT_OUT" ]; then
+			break
+		fi
+	done
+	SENTINEL=`head -n 1 "$ALT_OUT"`
+	cat "$1/eval-match" >> "$TMP"
+	cat "$1/eval-mismatch" >> "$TMP"
+	echo >> "$TMP" # unfinished line is not evaluated until its end appended
+	for i in `seq 50`; do
+		if grep -vxF -e "$SENTINEL" "$ALT_OUT" | cmp -s "$OUT.follow"; then
+			break
+		fi
+		sleep 0.1
+	done
+	kill $PID
+	wait $PID 2>/dev/null
+	if ! grep -vxF -e "$SENTINEL" "$ALT_OUT" | cmp -s "$OUT.follow"; then
+		Test_Failed "$1" "followed eval differs"
+	fi
+	rm -f "$OUT.follow" "$ALT_OUT"
+}
+
+function Test_Serve
+{
+	SOCK=/tmp/strange.$$.sock
+	"$RESULTS/strange" -serve "$SOCK" &
+	PID=$!
+	for i in `seq 50`; do
+		if [ -S "$SOCK" ]; then
+			break
+		fi
+		sleep 0.1
+	done
+
+	echo "load t $TRIE" > "$TMP"
+	grep -v '^$' "$1/eval-match" | sed 's/^/eval t /' >> "$TMP"
+	grep -v '^$' "$1/eval-mismatch" | sed 's/^/eval t /' >> "$TMP"
+	(echo ok; grep -v '^$' "$1/eval-match" | sed 's/.*/match/'; grep -v '^$' "$1/eval-mismatch" | sed 's/.*/mismatch/') > "$OUT.serve"
+	"$RESULTS/strange" -request "$SOCK" "$TMP" > "$ALT_OUT"
+	if ! cmp -s "$OUT.serve" "$ALT_OUT"; then
+		Test_Failed "$1" "served eval differs"
+	fi
+
+	cat ./$1/sample.* | grep -v '^$' | sed 's/^/learn l /' > "$TMP"
+	echo "save l $ALT_TRIE" >> "$TMP"
+	"$RESULTS/strange" -request "$SOCK" "$TMP" > /dev/null
+	"$RESULTS/strange" -learn ./$1/sample.* -save-compact "$OUT.serve"
+	if ! cmp -s "$OUT.serve" "$ALT_TRIE"; then
+		Test_Failed "$1" "served learn differs"
+	fi
+
+	# learned trie has no path to save into by default
+	echo "save l" > "$TMP"
+	if [ "`"$RESULTS/strange" -request "$SOCK" "$TMP"`" != "error no path" ] || [ -e .tmp ]; then
+		Test_Failed "$1" "served save without path"
+	fi
+	rm -f .tmp
+
+	# path of served socket must not be taken over by another server
+	if "$RESULTS/strange" -serve "$SOCK" 2>/dev/null; then
+		Test_Failed "$1" "served socket taken over"
+	fi
+
+	kill $PID
+	wait $PID 2>/dev/null
+
+	# existing file that is not a socket must be kept intact
+	echo "not a socket" > "$ALT_OUT"
+	if "$RESULTS/strange" -serve "$ALT_OUT" 2>/dev/null || [ "`cat "$ALT_OUT"`" != "not a socket" ]; then
+		Test_Failed "$1" "serve replaced regular file"
+	fi
+	rm -f "$SOCK" "$OUT.serve" "$ALT_OUT" "$ALT_TRIE"
+}
+
+function Test_Binary
+{
+	"$RESULTS/strange" -load "$TRIE" -save-binary "$ALT_TRIE"
+	for f in eval-match eval-mismatch; do
+		"$RESULTS/strange" -load "$TRIE" -descript -eval "$1/$f" > "$TMP"
+		EC=$?
+		"$RESULTS/strange" -load "$ALT_TRIE" -descript -eval "$1/$f" > "$ALT_OUT"
+		if [ $? -ne $EC ] || ! cmp -s "$TMP" "$ALT_OUT"; then
+			Test_Failed "$1" "binary trie eval differs: $f"
+		fi
+	done
+	"$RESULTS/strange" -load "$ALT_TRIE" -save "$ALT_OUT"
+	if ! cmp -s "$TRIE" "$ALT_OUT"; then
+		Test_Failed "$1" "binary trie differs"
+	fi
+	# binary trie is mapped from file, so saving into same file must not break it
+	cp "$ALT_TRIE" "$ALT_OUT"
+	"$RESULTS/strange" -load "$ALT_TRIE" -save-binary "$ALT_TRIE"
+	if ! cmp -s "$ALT_TRIE" "$ALT_OUT"; then
+		Test_Failed "$1" "binary trie saved over itself differs"
+	fi
+	"$RESULTS/strange" -load "$ALT_TRIE" -save-compact "$ALT_TRIE"
+	"$RESULTS/strange" -load "$TRIE" -save-compact "$ALT_OUT"
+	if ! cmp -s "$ALT_TRIE" "$ALT_OUT"; then
+		Test_Failed "$1" "binary trie saved over itself as text differs"
+	fi
+	rm -f "$ALT_OUT" "$ALT_TRIE"
+}
+
+function Test_Dag
+{
+	"$RESULTS/strange" -load "$TRIE" -dag -save "$ALT_TRIE" -save-binary "$ALT_TRIE.bin"
+	for f in eval-match eval-mismatch; do
+		"$RESULTS/strange" -load "$TRIE" -descript -eval "$1/$f" > "$TMP"
+		EC=$?
+		for f_trie in "$ALT_TRIE" "$ALT_TRIE.bin"; do
+			"$RESULTS/strange" -load "$f_trie" -descript -eval "$1/$f" > "$ALT_OUT"
+			if [ $? -ne $EC ] || ! cmp -s "$TMP" "$ALT_OUT"; then
+				Test_Failed "$1" "shared subtrees trie eval differs: $f"
+			fi
+		done
+	done
+	"$RESULTS/strange" -load "$ALT_TRIE" -save-binary "$ALT_TRIE.bin"
+	"$RESULTS/strange" -load "$ALT_TRIE.bin" -save "$ALT_OUT"
+	if ! cmp -s "$TRIE" "$ALT_OUT"; then
+		Test_Failed "$1" "shared subtrees trie differs"
+	fi
+	rm -f "$ALT_OUT" "$ALT_TRIE" "$ALT_TRIE.bin"
+}
+
+function Test_Malformed
+{
+	sed '3s/^ */&#/' "$TRIE" > "$ALT_TRIE"
+	if "$RESULTS/strange" -load "$ALT_TRIE" -eval "$1/eval-match" > "$ALT_OUT" 2>&1 \
+	  || ! grep -q "trie line 3:" "$ALT_OUT"; then
+		Test_Failed "$1" "malformed trie not reported"
+	fi
+	rm -f "$ALT_OUT" "$ALT_TRIE"
+}
+
+function Test_LearnLimit
+{
+	"$RESULTS/strange" -learn-limit 1K -learn ./$1/sample.* -save "$ALT_TRIE" >> "$OUT"
+	for f in ./$1/sample.* "$1/eval-match"; do
+		if ! "$RESULTS/strange" -load "$ALT_TRIE" -eval "$f" >> "$OUT"; then
+			Test_Failed "$1" "batched learn mismatch unexpected: $f"
+		fi
+	done
+	rm -f "$ALT_TRIE"
+}
+
 function Test_Run
 {
 	rm -f "$OUT" "$TRIE" "$TMP"
 	"$RESULTS/strange" -learn ./$1/sample.* -save "$TRIE" >> "$OUT"
+	"$RESULTS/strange" -threads 3 -learn ./$1/sample.* -save "$ALT_TRIE" >> "$OUT"
+	if ! cmp -s "$TRIE" "$ALT_TRIE"; then
+		Test_Failed "$1" "threaded learn differs"
+	fi
 	Test_Eval "$1"
-	rm -f "$TRIE" "$TMP"
+	Test_Threads "$1"
+	Test_DescriptBudget "$1"
+	Test_Cache "$1"
+	Test_Follow "$1"
+	Test_Serve "$1"
+	Test_Binary "$1"
+	Test_Dag "$1"
+	Test_Malformed "$1"
+	Test_LearnLimit "$1"
+	rm -f "$TRIE" "$ALT_TRIE" "$TMP"
 
 	echo "" >> "$OUT"
 	echo " --- " >> "$OUT"
 
 	LOAD_ARG=()
+	ALT_LOAD_ARG=()
 	for f in `ls ./$1/sample.* | sort -V`; do
 		"$RESULTS/strange" "${LOAD_ARG[@]}" -learn "$f" -save "$TRIE" >> "$OUT"
+		"$RESULTS/strange" "${ALT_LOAD_ARG[@]}" -threads 3 -learn "$f" -save "$ALT_TRIE" >> "$OUT"
 		LOAD_ARG=(-load "$TRIE")
+		ALT_LOAD_ARG=(-load "$ALT_TRIE")
 	done
+	if ! cmp -s "$TRIE" "$ALT_TRIE"; then
+		Test_Failed "$1" "threaded incremental learn differs"
+	fi
 	Test_Eval "$1"
-	rm -f "$OUT" "$TRIE" "$TMP"
+	rm -f "$OUT" "$TRIE" "$ALT_TRIE" "$TMP"
 }
 
 rm -rf "$RESULTS/test/"